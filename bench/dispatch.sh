@@ -0,0 +1,7 @@
+#!/bin/bash
+# counts how many dispatches the quiet interpreter needs for the instructions each program runs, run from the repo root.
+# every instruction is one dispatch without superinstructions, so the two counts are the before and after of fusing
+gcc -O2 -DVM_COUNT_DISPATCH -o bench/dispatch src/*.c src/assembler/*.c -lm -pthread || exit 1
+for program in bench/loop.asm bench/sort.asm bench/rmw.asm; do
+    echo "$program: $(bench/dispatch "$program" | tail -n 1)"
+done
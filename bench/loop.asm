@@ -0,0 +1,11 @@
+.orig x3000
+  LD R1, COUNT
+OUTER LD R2, INNER_COUNT
+INNER ADD R2, R2, -1
+  BRp INNER
+  ADD R1, R1, -1
+  BRp OUTER
+  HALT
+COUNT .fill 2000
+INNER_COUNT .fill 10000
+.end
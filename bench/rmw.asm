@@ -0,0 +1,19 @@
+.orig x3000
+  LD R5, PASSES
+AGAIN LEA R1, TABLE
+  AND R2, R2, 0
+  ADD R2, R2, 8
+FILL LDR R3, R1, 0
+  ADD R3, R3, 1
+  STR R3, R1, 0
+  AND R4, R4, 0
+  ADD R4, R4, 3
+  ADD R1, R1, 1
+  ADD R2, R2, -1
+  BRp FILL
+  ADD R5, R5, -1
+  BRp AGAIN
+  HALT
+PASSES .fill 30000
+TABLE .blkw 8
+.end
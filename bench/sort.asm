@@ -0,0 +1,339 @@
+.orig x3000
+  LD R6, ROUNDS
+AGAIN LD R0, ARRP
+  LD R1, SRCP
+  LD R2, N
+COPY LDR R3, R1, 0
+  STR R3, R0, 0
+  ADD R0, R0, 1
+  ADD R1, R1, 1
+  ADD R2, R2, -1
+  BRp COPY
+  JSR SORT
+  ADD R6, R6, -1
+  BRp AGAIN
+  HALT
+ROUNDS .fill 20
+ARRP .fill ARR
+SRCP .fill SRC
+N .fill 300
+SORT LD R2, N
+  ADD R2, R2, -1
+OUTER LD R0, ARRP
+  ADD R1, R2, 0
+INNER LDR R3, R0, 0
+  LDR R4, R0, 1
+  NOT R5, R4
+  ADD R5, R5, 1
+  ADD R5, R3, R5
+  BRnz NOSWAP
+  STR R4, R0, 0
+  STR R3, R0, 1
+NOSWAP ADD R0, R0, 1
+  ADD R1, R1, -1
+  BRp INNER
+  ADD R2, R2, -1
+  BRp OUTER
+  RET
+SRC .fill 4402
+  .fill 18651
+  .fill 27768
+  .fill 26288
+  .fill 25027
+  .fill 2067
+  .fill 8358
+  .fill 3863
+  .fill 16234
+  .fill 24935
+  .fill 14728
+  .fill 15474
+  .fill 21351
+  .fill 12439
+  .fill 25844
+  .fill 6879
+  .fill 3075
+  .fill 15986
+  .fill 928
+  .fill 29272
+  .fill 27386
+  .fill 12773
+  .fill 14180
+  .fill 19904
+  .fill 24978
+  .fill 25138
+  .fill 69
+  .fill 22801
+  .fill 14594
+  .fill 8727
+  .fill 23643
+  .fill 26274
+  .fill 7496
+  .fill 19370
+  .fill 3349
+  .fill 29537
+  .fill 10401
+  .fill 1002
+  .fill 731
+  .fill 833
+  .fill 21284
+  .fill 17741
+  .fill 301
+  .fill 28876
+  .fill 12491
+  .fill 22494
+  .fill 7097
+  .fill 13831
+  .fill 23784
+  .fill 951
+  .fill 17289
+  .fill 7264
+  .fill 25024
+  .fill 14348
+  .fill 16246
+  .fill 18116
+  .fill 7637
+  .fill 11327
+  .fill 7565
+  .fill 22178
+  .fill 7169
+  .fill 24934
+  .fill 15060
+  .fill 9495
+  .fill 704
+  .fill 13637
+  .fill 27445
+  .fill 18233
+  .fill 21046
+  .fill 3276
+  .fill 6091
+  .fill 20622
+  .fill 23712
+  .fill 28178
+  .fill 9712
+  .fill 3961
+  .fill 24351
+  .fill 10901
+  .fill 29346
+  .fill 23641
+  .fill 23304
+  .fill 16410
+  .fill 13831
+  .fill 16636
+  .fill 27198
+  .fill 29824
+  .fill 21964
+  .fill 6220
+  .fill 9940
+  .fill 9311
+  .fill 19253
+  .fill 28917
+  .fill 16363
+  .fill 27728
+  .fill 16557
+  .fill 12889
+  .fill 19300
+  .fill 27960
+  .fill 1131
+  .fill 15736
+  .fill 7954
+  .fill 24370
+  .fill 26129
+  .fill 13247
+  .fill 13576
+  .fill 21782
+  .fill 5669
+  .fill 12029
+  .fill 17983
+  .fill 28925
+  .fill 23037
+  .fill 25422
+  .fill 22101
+  .fill 24189
+  .fill 12278
+  .fill 2833
+  .fill 14383
+  .fill 21750
+  .fill 16660
+  .fill 3536
+  .fill 25508
+  .fill 5364
+  .fill 17070
+  .fill 27523
+  .fill 12886
+  .fill 12141
+  .fill 16046
+  .fill 24011
+  .fill 969
+  .fill 15378
+  .fill 1424
+  .fill 10109
+  .fill 23048
+  .fill 27797
+  .fill 20146
+  .fill 19437
+  .fill 18945
+  .fill 12897
+  .fill 21206
+  .fill 5582
+  .fill 5524
+  .fill 16457
+  .fill 7436
+  .fill 403
+  .fill 25248
+  .fill 6537
+  .fill 17682
+  .fill 28189
+  .fill 17967
+  .fill 7607
+  .fill 13253
+  .fill 16835
+  .fill 11266
+  .fill 27769
+  .fill 18933
+  .fill 11576
+  .fill 15044
+  .fill 29810
+  .fill 8823
+  .fill 21601
+  .fill 17956
+  .fill 19953
+  .fill 23900
+  .fill 187
+  .fill 12572
+  .fill 25678
+  .fill 28080
+  .fill 26885
+  .fill 29038
+  .fill 24264
+  .fill 16793
+  .fill 26513
+  .fill 4235
+  .fill 16996
+  .fill 25473
+  .fill 18394
+  .fill 6733
+  .fill 13962
+  .fill 1839
+  .fill 15764
+  .fill 28508
+  .fill 11951
+  .fill 18677
+  .fill 18166
+  .fill 6548
+  .fill 16538
+  .fill 13546
+  .fill 15890
+  .fill 26651
+  .fill 11691
+  .fill 13579
+  .fill 11340
+  .fill 51
+  .fill 17644
+  .fill 17698
+  .fill 20430
+  .fill 25770
+  .fill 20068
+  .fill 10850
+  .fill 15012
+  .fill 19656
+  .fill 916
+  .fill 26364
+  .fill 7523
+  .fill 20819
+  .fill 5806
+  .fill 18047
+  .fill 19151
+  .fill 5923
+  .fill 28213
+  .fill 3001
+  .fill 26163
+  .fill 18056
+  .fill 26119
+  .fill 27894
+  .fill 26753
+  .fill 8365
+  .fill 1063
+  .fill 27582
+  .fill 22056
+  .fill 2308
+  .fill 2727
+  .fill 28445
+  .fill 546
+  .fill 14843
+  .fill 477
+  .fill 24711
+  .fill 24759
+  .fill 9214
+  .fill 8177
+  .fill 8802
+  .fill 3587
+  .fill 26125
+  .fill 20473
+  .fill 6049
+  .fill 11286
+  .fill 9512
+  .fill 2277
+  .fill 5487
+  .fill 5230
+  .fill 8362
+  .fill 17281
+  .fill 5509
+  .fill 21517
+  .fill 8942
+  .fill 21240
+  .fill 23317
+  .fill 9649
+  .fill 14899
+  .fill 23023
+  .fill 10551
+  .fill 16269
+  .fill 15524
+  .fill 3741
+  .fill 774
+  .fill 10223
+  .fill 12666
+  .fill 11250
+  .fill 13792
+  .fill 26089
+  .fill 6161
+  .fill 8467
+  .fill 3563
+  .fill 8305
+  .fill 29485
+  .fill 23925
+  .fill 16715
+  .fill 6851
+  .fill 19845
+  .fill 14144
+  .fill 26772
+  .fill 682
+  .fill 7385
+  .fill 585
+  .fill 13019
+  .fill 4799
+  .fill 1157
+  .fill 23554
+  .fill 5250
+  .fill 14603
+  .fill 23088
+  .fill 16590
+  .fill 22222
+  .fill 13980
+  .fill 17848
+  .fill 27271
+  .fill 7228
+  .fill 20669
+  .fill 26142
+  .fill 22775
+  .fill 16927
+  .fill 14773
+  .fill 7313
+  .fill 17167
+  .fill 21250
+  .fill 1005
+  .fill 12940
+  .fill 22115
+  .fill 18869
+  .fill 26325
+ARR .blkw 300
+.end
@@ -0,0 +1,189 @@
+// compares the keyword switch the tokenizer uses against the table walk it replaced, on a generated source. build
+// from the repo root with
+//     gcc -O2 -o bench/tokenize bench/tokenize.c src/assembler/{token,source}.c src/arena.c src/utils.c -lm -pthread
+// and run as bench/tokenize [lines], 500000 lines by default. the rest of tokenizing didn't change, so tokenize_lines
+// with the tables took about as much longer as the table walk does over the switch
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+
+#include "../src/arena.h"
+#include "../src/assembler/source.h"
+#include "../src/assembler/token.h"
+#include "../src/utils.h"
+
+// from token.c, which doesn't export them
+bool match_keyword(const char *text, size_t len, TokenType *type, BrFlags *br_flags);
+bool match_pseudoop(const char *text, size_t len, TokenType *type);
+
+// the tables as they were, JMP was missing from them
+const struct {
+    char *string;
+    TokenType type;
+} TOKEN_STRS[] = {
+    {"ADD", ADD}, {"AND", AND},   {"JSR", JSR}, {"JSRR", JSRR}, {"LD", LD},   {"LDI", LDI},   {"LDR", LDR},
+    {"LEA", LEA}, {"NOT", NOT},   {"RTI", RTI}, {"ST", ST},     {"STI", STI}, {"STR", STR},   {"TRAP", TRAP},
+    {"RET", RET}, {"GETC", GETC}, {"OUT", OUT}, {"PUTS", PUTS}, {"IN", IN},   {"HALT", HALT},
+};
+
+const struct {
+    char *string;
+    TokenType type;
+} PSEUDOOP_STRS[] = {{"ORIG", ORIG}, {"FILL", FILL}, {"BLKW", BLKW}, {"STRINGZ", STRINGZ}, {"END", END}};
+
+const struct {
+    char *string;
+    BrFlags br_flags;
+} BR_STRS[] = {
+    {"BR", {.n = true, .z = true, .p = true}},
+    {"BRN", {.n = true}},
+    {"BRZ", {.z = true}},
+    {"BRP", {.p = true}},
+    {"BRNZ", {.n = true, .z = true}},
+    {"BRNP", {.n = true, .p = true}},
+    {"BRZP", {.z = true, .p = true}},
+    {"BRNZP", {.n = true, .z = true, .p = true}},
+};
+
+// the lookup line_tokenizer_next_token did before the switch, TEXT when nothing matched
+TokenType classify_tables(const char *text, size_t len) {
+    for (size_t i = 0; i < sizeof(TOKEN_STRS) / sizeof(TOKEN_STRS[0]); i++) {
+        if (strncasecmp(text, TOKEN_STRS[i].string, len) == 0 && TOKEN_STRS[i].string[len] == 0)
+            return TOKEN_STRS[i].type;
+    }
+    for (size_t i = 0; i < sizeof(BR_STRS) / sizeof(BR_STRS[0]); i++) {
+        if (strncasecmp(text, BR_STRS[i].string, len) == 0 && BR_STRS[i].string[len] == 0)
+            return BR;
+    }
+    if (text[0] == '.') {
+        for (size_t i = 0; i < sizeof(PSEUDOOP_STRS) / sizeof(PSEUDOOP_STRS[0]); i++) {
+            if (strncasecmp(text + 1, PSEUDOOP_STRS[i].string, len - 1) == 0 && PSEUDOOP_STRS[i].string[len - 1] == 0)
+                return PSEUDOOP_STRS[i].type;
+        }
+    }
+    return TEXT;
+}
+
+TokenType classify_switch(const char *text, size_t len) {
+    TokenType type;
+    BrFlags br_flags;
+    if (match_keyword(text, len, &type, &br_flags))
+        return type;
+    if (text[0] == '.' && match_pseudoop(text + 1, len - 1, &type))
+        return type;
+    return TEXT;
+}
+
+// a mix of labels, instructions, directives and comments like a hand written program has
+const char *LINES[] = {
+    "LOOP    ADD R1, R1, #-1",
+    "        and r0, r0, #0",
+    "        LDR R4, R5, #-3",
+    "        BRnp LOOP",
+    "        LEA R0, MSG",
+    "MSG     .STRINGZ \"hello\"",
+    "        .FILL x1234",
+    "; a comment on its own",
+    "        JSR SUB ; call it",
+    "        st R1, COUNT",
+    "        TRAP x25",
+    "BUF     .BLKW 3",
+    "        JMP R2",
+    "        puts",
+    "COUNT   .fill #0",
+    "",
+};
+
+double now_ms(void) {
+    struct timespec time;
+    clock_gettime(CLOCK_MONOTONIC, &time);
+    return time.tv_sec * 1e3 + time.tv_nsec / 1e6;
+}
+
+int main(int argc, char **argv) {
+    size_t line_count = argc > 1 ? strtoull(argv[1], NULL, 10) : 500000;
+    size_t line_kinds = sizeof(LINES) / sizeof(LINES[0]);
+    uint64_t seed = 1;
+    size_t cap = line_count * 32 + 1, len = 0;
+    char *text = malloc(cap);
+    for (size_t i = 0; i < line_count; i++)
+        len += snprintf(text + len, cap - len, "%s\n", LINES[splitmix64(&seed) % line_kinds]);
+
+    // every word the keyword lookup sees, split the way the tokenizer splits them, leaving out comments and strings
+    size_t word_cap = line_count * 8, word_len = 0;
+    const char **words = malloc(sizeof(char *) * word_cap);
+    size_t *word_lens = malloc(sizeof(size_t) * word_cap);
+    for (size_t i = 0; i < len;) {
+        if (text[i] == ';' || text[i] == '"') {
+            char stop = text[i] == ';' ? '\n' : '"';
+            for (i++; i < len && text[i] != stop; i++)
+                ;
+            i++;
+            continue;
+        }
+        if (strchr(" \t\r\n,", text[i])) {
+            i++;
+            continue;
+        }
+        size_t start = i;
+        while (i < len && !strchr(" \t\r\n,;\"", text[i]))
+            i++;
+        words[word_len] = text + start;
+        word_lens[word_len++] = i - start;
+    }
+
+    // the two agree on everything but JMP, which the tables never had
+    for (size_t i = 0; i < word_len; i++) {
+        TokenType old = classify_tables(words[i], word_lens[i]), new = classify_switch(words[i], word_lens[i]);
+        if (old != new && !(new == JMP && old == TEXT)) {
+            printf("mismatch on %.*s\n", (int)word_lens[i], words[i]);
+            return 1;
+        }
+    }
+
+    double best_tables = 1e9, best_switch = 1e9, best_tokenize = 1e9;
+    uint64_t sum = 0;
+    for (int run = 0; run < 5; run++) {
+        double start = now_ms();
+        for (size_t i = 0; i < word_len; i++)
+            sum += classify_tables(words[i], word_lens[i]);
+        double tables = now_ms() - start;
+        start = now_ms();
+        for (size_t i = 0; i < word_len; i++)
+            sum += classify_switch(words[i], word_lens[i]);
+        double switched = now_ms() - start;
+
+        SourceFile source;
+        source_file_from_text(&source, text, len);
+        Arena arena;
+        arena_init(&arena);
+        LineTokensList list;
+        size_t lines_read;
+        start = now_ms();
+        if (tokenize_lines(&arena, &list, source.lines, source.line_count, &lines_read) != LT_SUCCESS) {
+            printf("tokenizing failed at line %lu\n", lines_read);
+            return 1;
+        }
+        double tokenize = now_ms() - start;
+        sum += list.token_len;
+        arena_free(&arena);
+        source_file_close(&source);
+
+        best_tables = tables < best_tables ? tables : best_tables;
+        best_switch = switched < best_switch ? switched : best_switch;
+        best_tokenize = tokenize < best_tokenize ? tokenize : best_tokenize;
+    }
+
+    printf("%lu lines, %lu words (checksum %lu)\n", line_count, word_len, sum);
+    printf("keyword tables  %8.2f ms  %6.2f ns/word\n", best_tables, best_tables * 1e6 / word_len);
+    printf("keyword switch  %8.2f ms  %6.2f ns/word\n", best_switch, best_switch * 1e6 / word_len);
+    printf("tokenize_lines  %8.2f ms\n", best_tokenize);
+    free(words);
+    free(word_lens);
+    free(text);
+    return 0;
+}
@@ -0,0 +1,89 @@
+#include "arena.h"
+
+#include <stdalign.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define ARENA_MIN_BLOCK (64 * 1024)
+#define ARENA_MAX_BLOCK (8 * 1024 * 1024)
+#define ARENA_ALIGN alignof(max_align_t)
+
+struct ArenaBlock {
+    ArenaBlock *prev;
+    size_t used;
+    size_t cap;
+    size_t last;  // offset of the most recent allocation, so it can be grown in place
+    alignas(max_align_t) uint8_t data[];
+};
+
+size_t align_up(size_t size) {
+    return (size + ARENA_ALIGN - 1) & ~(ARENA_ALIGN - 1);
+}
+
+void arena_init(Arena *arena) {
+    arena->head = NULL;
+}
+
+ArenaBlock *arena_new_block(Arena *arena, size_t size) {
+    // each block doubles the last one so big sessions only need a handful of blocks
+    size_t cap = arena->head ? arena->head->cap * 2 : ARENA_MIN_BLOCK;
+    if (cap > ARENA_MAX_BLOCK)
+        cap = ARENA_MAX_BLOCK;
+    if (cap < size)
+        cap = size;
+
+    ArenaBlock *block = malloc(sizeof(ArenaBlock) + cap);
+    *block = (ArenaBlock){.prev = arena->head, .used = 0, .cap = cap, .last = 0};
+    arena->head = block;
+    return block;
+}
+
+void *arena_alloc(Arena *arena, size_t size) {
+    size = align_up(size);
+    ArenaBlock *block = arena->head;
+    if (!block || block->cap - block->used < size)
+        block = arena_new_block(arena, size);
+
+    block->last = block->used;
+    block->used += size;
+    return block->data + block->last;
+}
+
+void *arena_grow(Arena *arena, void *ptr, size_t old_size, size_t new_size) {
+    if (!ptr)
+        return arena_alloc(arena, new_size);
+
+    ArenaBlock *block = arena->head;
+    if (block && (uint8_t *)ptr == block->data + block->last && block->cap - block->last >= align_up(new_size)) {
+        block->used = block->last + align_up(new_size);
+        return ptr;
+    }
+
+    void *moved = arena_alloc(arena, new_size);
+    memcpy(moved, ptr, old_size < new_size ? old_size : new_size);
+    return moved;
+}
+
+void arena_adopt(Arena *arena, Arena *other) {
+    if (!other->head)
+        return;
+    ArenaBlock *oldest = other->head;
+    while (oldest->prev)
+        oldest = oldest->prev;
+    // the blocks go under the head, which is the only one allocations come from
+    if (arena->head) {
+        oldest->prev = arena->head->prev;
+        arena->head->prev = other->head;
+    } else
+        arena->head = other->head;
+    other->head = NULL;
+}
+
+void arena_free(Arena *arena) {
+    while (arena->head) {
+        ArenaBlock *prev = arena->head->prev;
+        free(arena->head);
+        arena->head = prev;
+    }
+}
@@ -0,0 +1,23 @@
+#pragma once
+
+#include <stddef.h>
+
+typedef struct ArenaBlock ArenaBlock;
+
+// bump allocator where everything is released at once with arena_free
+typedef struct {
+    ArenaBlock *head;
+} Arena;
+
+void arena_init(Arena *arena);
+
+void *arena_alloc(Arena *arena, size_t size);
+
+// grows the most recent allocation in place if the block has room, otherwise moves it to a new spot
+void *arena_grow(Arena *arena, void *ptr, size_t old_size, size_t new_size);
+
+// moves every block of other into arena and leaves other empty, so allocations made in other, say by another thread,
+// live until arena is freed. arena keeps growing its most recent allocation in place
+void arena_adopt(Arena *arena, Arena *other);
+
+void arena_free(Arena *arena);
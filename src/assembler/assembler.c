@@ -0,0 +1,34 @@
+#include <stddef.h>
+
+#include "../arena.h"
+#include "../utils.h"
+#include "assembler.h"
+#include "object.h"
+#include "parser.h"
+#include "source.h"
+#include "symbol.h"
+#include "token.h"
+
+AssembleResult assemble(Arena *arena, const SourceFile *source, ObjectImage *image, size_t *lines_read) {
+    LineTokensList token_list;
+    if (tokenize_lines(arena, &token_list, source->lines, source->line_count, lines_read) != LT_SUCCESS)
+        return AS_TOKENIZE_FAILED;
+
+    // for sources big enough to split up, the symbol pass gives every line its address so parsing and encoding can
+    // run on several threads
+    SymbolTable symbol_table;
+    if (parallel_threads(token_list.len, ENCODE_CHUNK_LINES) > 1) {
+        if (generate_symbol_table(arena, &symbol_table, &token_list, lines_read) != ST_SUCCESS)
+            return AS_SYMBOL_FAILED;
+        if (encode_source(arena, image, &token_list, &symbol_table, lines_read) != PS_SUCCESS)
+            return AS_PARSE_FAILED;
+        return AS_SUCCESS;
+    }
+
+    Instructions instructions;
+    if (parse_instructions_single_pass(arena, &instructions, &symbol_table, &token_list, lines_read) != PS_SUCCESS)
+        return AS_PARSE_FAILED;
+
+    encode_object_image(arena, image, &instructions);
+    return AS_SUCCESS;
+}
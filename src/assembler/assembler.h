@@ -0,0 +1,18 @@
+#pragma once
+
+#include <stddef.h>
+
+#include "../arena.h"
+#include "object.h"
+#include "source.h"
+
+typedef enum {
+    AS_SUCCESS,
+    AS_TOKENIZE_FAILED,
+    AS_SYMBOL_FAILED,  // only from the two pass path big sources take
+    AS_PARSE_FAILED,
+} AssembleResult;
+
+// runs the whole pipeline on source without printing anything, leaving the image in arena. on failure lines_read is
+// the line that failed
+AssembleResult assemble(Arena *arena, const SourceFile *source, ObjectImage *image, size_t *lines_read);
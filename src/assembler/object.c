@@ -1,148 +1,373 @@
+#include <pthread.h>
+#include <stdatomic.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 
+#include "../arena.h"
 #include "../utils.h"
 #include "object.h"
 #include "parser.h"
 
-typedef struct {
-    uint16_t *offsets;
-    size_t len;
-} Offsets;
-
-Offsets orig_offset_count(const Instructions *instructions) {
-    uint16_t cur_offset;
-    size_t offsets_cap = 5;
-    Offsets offsets = {.offsets = malloc(sizeof(uint16_t) * offsets_cap), .len = 0};
+// encodes an instruction that takes up exactly one word, which is everything but .ORIG, .BLKW, .STRINGZ and .END
+uint16_t encode_instruction(const Instruction *instr) {
+    const union InstructionData *data = &instr->data;
+    switch (instr->type) {
+        case INSTR_FILL:
+            return data->u16;
+        case INSTR_ADD:
+            return (0b0001 << 12) | (data->dr << 9) | (data->sr1 << 6) | data->sr2;
+        case INSTR_ADD_IMM:
+            return (0b0001 << 12) | (data->dr << 9) | (data->sr1 << 6) | (1 << 5) | data->imm;
+        case INSTR_AND:
+            return (0b0101 << 12) | (data->dr << 9) | (data->sr1 << 6) | data->sr2;
+        case INSTR_AND_IMM:
+            return (0b0101 << 12) | (data->dr << 9) | (data->sr1 << 6) | (1 << 5) | data->imm;
+        case INSTR_BR:
+            return (data->br_flags.n << 11) | (data->br_flags.z << 10) | (data->br_flags.p << 9) | data->offset;
+        case INSTR_JMP:
+            return (0b1100 << 12) | (data->base_r << 6);
+        case INSTR_JSR:
+            return (0b0100 << 12) | (1 << 11) | data->offset;
+        case INSTR_JSRR:
+            return (0b0100 << 12) | (data->base_r << 6);
+        case INSTR_LD:
+            return (0b0010 << 12) | (data->dr << 9) | data->offset;
+        case INSTR_LDI:
+            return (0b1010 << 12) | (data->dr << 9) | data->offset;
+        case INSTR_LDR:
+            return (0b0110 << 12) | (data->dr << 9) | (data->base_r << 6) | data->offset;
+        case INSTR_LEA:
+            return (0b1110 << 12) | (data->dr << 9) | data->offset;
+        case INSTR_NOT:
+            return (0b1001 << 12) | (data->dr << 9) | (data->sr1 << 6) | 0b111111;
+        case INSTR_RTI:
+            return 0b1000 << 12;
+        case INSTR_ST:
+            return (0b0011 << 12) | (data->sr1 << 9) | data->offset;
+        case INSTR_STI:
+            return (0b1011 << 12) | (data->sr1 << 9) | data->offset;
+        case INSTR_STR:
+            return (0b0111 << 12) | (data->sr1 << 9) | (data->base_r << 6) | data->offset;
+        case INSTR_TRAP:
+            return (0b1111 << 12) | (data->u16);
+        default:
+            return 0;
+    }
+}
+
+void object_image_size(const Instructions *instructions, size_t *word_count, size_t *segment_count) {
+    *word_count = 0;
+    *segment_count = 0;
     for (size_t i = 0; i < instructions->len; i++) {
-        Instruction *instr = &instructions->instructions[i];
+        const Instruction *instr = &instructions->instructions[i];
         switch (instr->type) {
             case INSTR_ORIG:
-                cur_offset = 0;
-                break;
-            case INSTR_END:
-                if (offsets.len == offsets_cap)
-                    offsets.offsets = realloc(offsets.offsets, sizeof(uint16_t) * (offsets_cap *= 2));
-                offsets.offsets[offsets.len++] = cur_offset;
+                (*segment_count)++;
                 break;
             case INSTR_BLKW:
-                cur_offset += instr->data.u16;
+                *word_count += instr->data.u16;
+                break;
+            case INSTR_STRINGZ:
+                *word_count += instr->data.text_len + 1;
                 break;
-            case INSTR_STRINGZ:;
-                char *unescaped;
-                size_t output_len;
-                UnescapeResult r = unescape_string(instr->data.text, instr->data.text_len, &unescaped, &output_len);
-                size_t len = (r == US_ALLOC) ? output_len : instr->data.text_len;
-                if (r == US_ALLOC)
-                    free(unescaped);
-                cur_offset += len + 1;
+            case INSTR_END:
                 break;
             default:
-                cur_offset++;
+                (*word_count)++;
                 break;
         }
     }
+}
 
-    // reverse array to easily dequeue items
-    size_t i = 0, j = offsets.len - 1;
-    while (i < j) {
-        uint16_t temp = offsets.offsets[i];
-        offsets.offsets[i++] = offsets.offsets[j];
-        offsets.offsets[j--] = temp;
+// marks len words from start as reserved. runs encoded on different threads can share a u64 at their edges
+void reserve_words(uint64_t *reserved, size_t start, size_t len) {
+    for (size_t cur = start, end = start + len; cur < end;) {
+        size_t bits = 64 - cur % 64 < end - cur ? 64 - cur % 64 : end - cur;
+        uint64_t mask = (bits == 64 ? ~(uint64_t)0 : ((uint64_t)1 << bits) - 1) << (cur % 64);
+        atomic_fetch_or_explicit((_Atomic uint64_t *)&reserved[cur / 64], mask, memory_order_relaxed);
+        cur += bits;
     }
+}
 
-    return offsets;
+// encodes instructions from word cur of the image, with open the segment they start in. a segment is only written
+// out at its .END, so runs that split one between them never write the same entry
+void encode_range(const Instructions *instructions,
+                  uint16_t *out,
+                  ObjectSegment *segments,
+                  uint64_t *reserved,
+                  size_t cur,
+                  size_t segment,
+                  ObjectSegment open) {
+    for (size_t i = 0; i < instructions->len; i++) {
+        const Instruction *instr = &instructions->instructions[i];
+        const union InstructionData *data = &instr->data;
+        switch (instr->type) {
+            case INSTR_ORIG:
+                open = (ObjectSegment){.origin = data->u16, .len = 0, .offset = cur};
+                break;
+            case INSTR_END:
+                open.len = cur - open.offset;
+                segments[segment++] = open;
+                break;
+            case INSTR_BLKW:
+                memset(&out[cur], 0, sizeof(uint16_t) * data->u16);
+                reserve_words(reserved, cur, data->u16);
+                cur += data->u16;
+                break;
+            case INSTR_STRINGZ:
+                for (size_t i = 0; i < data->text_len; i++)
+                    out[cur++] = (uint8_t)data->text[i];
+                out[cur++] = 0;
+                break;
+            default:
+                out[cur++] = encode_instruction(instr);
+                break;
+        }
+    }
 }
 
-#define WRITE_HEX(i_item) fprintf(file, "%04X\n", i_item);
+void encode_instructions(const Instructions *instructions,
+                         uint16_t *out,
+                         ObjectSegment *segments,
+                         uint64_t *reserved) {
+    encode_range(instructions, out, segments, reserved, 0, 0, (ObjectSegment){0});
+}
 
-#define W(i_item)          \
-    do {                   \
-        WRITE_HEX(i_item); \
-        goto break_switch; \
-    } while (0)
+void encode_object_image(Arena *arena, ObjectImage *image, const Instructions *instructions) {
+    object_image_size(instructions, &image->len, &image->segment_len);
+    image->words = arena_alloc(arena, sizeof(uint16_t) * image->len);
+    image->segments = arena_alloc(arena, sizeof(ObjectSegment) * image->segment_len);
+    size_t reserved_len = (image->len + 63) / 64;
+    image->reserved = arena_alloc(arena, sizeof(uint64_t) * reserved_len);
+    memset(image->reserved, 0, sizeof(uint64_t) * reserved_len);
+    encode_instructions(instructions, image->words, image->segments, image->reserved);
+}
 
-bool write_to_object(const Instructions *instructions, char *file_name) {
-    FILE *file = fopen(file_name, "w");
-    if (file == NULL)
-        return false;
-    Offsets offsets = orig_offset_count(instructions);
-    fprintf(file, "LC-3 OBJ FILE\n\n.TEXT\n");
+// a run of lines parsed and encoded by one thread. the instructions only live in its arena until they're encoded
+typedef struct {
+    pthread_t thread;
+    bool threaded;  // false if the thread couldn't be created and the step ran on the caller's
+    Arena arena;
+    const LineTokensList *token_list;
+    const SymbolTable *symbol_table;
+    ObjectImage *image;
+    size_t first;
+    size_t count;
+    // from parsing: what the run adds to the image, and the segment it leaves open relative to its first word. open is
+    // then replaced by the segment the run starts in
+    Instructions instructions;
+    ParserResult result;
+    size_t lines_read;
+    int32_t next_address;
+    size_t words;
+    size_t ends;
+    bool reset;
+    ObjectSegment open;
+    // where the run goes in the image
+    size_t word_offset;
+    size_t segment_offset;
+} EncodeChunk;
 
-    for (size_t i = 0; i < instructions->len; i++) {
-        Instruction *instr = &instructions->instructions[i];
-        union InstructionData *data = &instr->data;
+void *parse_chunk(void *arg) {
+    EncodeChunk *chunk = arg;
+    chunk->next_address = chunk->count ? chunk->symbol_table->line_addrs[chunk->first] : -1;
+    chunk->result = parse_instruction_range(&chunk->arena, &chunk->instructions, chunk->token_list,
+                                            chunk->symbol_table, chunk->first, chunk->count, &chunk->next_address,
+                                            &chunk->lines_read);
+    if (chunk->result != PS_SUCCESS)
+        return NULL;
+    for (size_t i = 0; i < chunk->instructions.len; i++) {
+        const Instruction *instr = &chunk->instructions.instructions[i];
         switch (instr->type) {
             case INSTR_ORIG:
-                WRITE_HEX(data->u16);
-                fprintf(file, "%d\n", offsets.offsets[--offsets.len]);
+                chunk->reset = true;
+                chunk->open = (ObjectSegment){.origin = instr->data.u16, .len = 0, .offset = chunk->words};
+                break;
+            case INSTR_END:
+                chunk->reset = true;
+                chunk->ends++;
                 break;
-            case INSTR_FILL:
-                W(data->u16);
             case INSTR_BLKW:
-                for (uint16_t i = 0; i < data->u16; i++)
-                    fprintf(file, "????\n");
+                chunk->words += instr->data.u16;
                 break;
-            case INSTR_STRINGZ:;
-                char *unescaped;
-                size_t output_len;
-                UnescapeResult r = unescape_string(data->text, instr->data.text_len, &unescaped, &output_len);
-                const char *text = (r == US_ALLOC) ? unescaped : data->text;
-                if (r == US_ALLOC) {
-                    while (*text)
-                        WRITE_HEX(*text++);
-                } else {
-                    for (size_t i = 0; i < instr->data.text_len; i++)
-                        WRITE_HEX(data->text[i]);
-                }
-                WRITE_HEX(0);
-                if (r == US_ALLOC)
-                    free(unescaped);
+            case INSTR_STRINGZ:
+                chunk->words += instr->data.text_len + 1;
                 break;
-            case INSTR_ADD:
-                W((0b0001 << 12) | (data->dr << 9) | (data->sr1 << 6) | data->sr2);
-            case INSTR_ADD_IMM:
-                W((0b0001 << 12) | (data->dr << 9) | (data->sr1 << 6) | (1 << 5) | data->imm);
-            case INSTR_AND:
-                W((0b0101 << 12) | (data->dr << 9) | (data->sr1 << 6) | data->sr2);
-            case INSTR_AND_IMM:
-                W((0b0101 << 12) | (data->dr << 9) | (data->sr1 << 6) | (1 << 5) | data->imm);
-            case INSTR_BR:
-                W((data->br_flags.n << 11) | (data->br_flags.z << 10) | (data->br_flags.p << 9) | data->offset);
-            case INSTR_JMP:
-                W((0b1100 << 12) | (data->base_r << 6));
-            case INSTR_JSR:
-                W((0b0100 << 12) | (1 << 11) | data->offset);
-            case INSTR_JSRR:
-                W((0b0100 << 12) | (data->base_r << 6));
-            case INSTR_LD:
-                W((0b0010 << 12) | (data->dr << 9) | data->offset);
-            case INSTR_LDI:
-                W((0b1010 << 12) | (data->dr << 9) | data->offset);
-            case INSTR_LDR:
-                W((0b0110 << 12) | (data->dr << 9) | (data->base_r << 6) | data->offset);
-            case INSTR_LEA:
-                W((0b1110 << 12) | (data->dr << 9) | data->offset);
-            case INSTR_NOT:
-                W((0b1001 << 12) | (data->dr << 9) | (data->sr1 << 6) | 0b111111);
-            case INSTR_RTI:
-                W(0b1000 << 12);
-            case INSTR_ST:
-                W((0b0011 << 12) | (data->sr1 << 9) | data->offset);
-            case INSTR_STI:
-                W((0b1011 << 12) | (data->sr1 << 9) | data->offset);
-            case INSTR_STR:
-                W((0b0111 << 12) | (data->sr1 << 9) | (data->base_r << 6) | data->offset);
-            case INSTR_TRAP:
-                W((0b1111 << 12) | (data->u16));
-            case INSTR_END:
+            default:
+                chunk->words++;
                 break;
         }
-    break_switch:;
     }
+    return NULL;
+}
+
+void *encode_chunk(void *arg) {
+    EncodeChunk *chunk = arg;
+    ObjectImage *image = chunk->image;
+    encode_range(&chunk->instructions, image->words, image->segments, image->reserved, chunk->word_offset,
+                 chunk->segment_offset, chunk->open);
+    return NULL;
+}
+
+void run_encode_chunks(EncodeChunk *chunks, size_t count, void *(*step)(void *)) {
+    for (size_t i = 0; i < count; i++) {
+        chunks[i].threaded = pthread_create(&chunks[i].thread, NULL, step, &chunks[i]) == 0;
+        if (!chunks[i].threaded)
+            step(&chunks[i]);
+    }
+    for (size_t i = 0; i < count; i++) {
+        if (chunks[i].threaded)
+            pthread_join(chunks[i].thread, NULL);
+    }
+}
+
+ParserResult encode_source(Arena *arena,
+                           ObjectImage *image,
+                           const LineTokensList *token_list,
+                           const SymbolTable *symbol_table,
+                           size_t *lines_read) {
+    size_t thread_count = parallel_threads(token_list->len, ENCODE_CHUNK_LINES);
+    EncodeChunk *chunks = arena_alloc(arena, sizeof(EncodeChunk) * thread_count);
+    for (size_t i = 0; i < thread_count; i++) {
+        size_t first = i * token_list->len / thread_count, end = (i + 1) * token_list->len / thread_count;
+        chunks[i] = (EncodeChunk){.token_list = token_list,
+                                  .symbol_table = symbol_table,
+                                  .image = image,
+                                  .first = first,
+                                  .count = end - first};
+        arena_init(&chunks[i].arena);
+    }
+    if (thread_count == 1)
+        parse_chunk(&chunks[0]);
+    else
+        run_encode_chunks(chunks, thread_count, parse_chunk);
+
+    // chunks are in line order, so the first one that failed has the first line that did. otherwise a sum over them
+    // places each one in the image, along with the segment it starts in
+    ParserResult result = PS_SUCCESS;
+    size_t segment_count = 0;
+    ObjectSegment open = {0};
+    image->len = 0;
+    for (size_t i = 0; i < thread_count && result == PS_SUCCESS; i++) {
+        EncodeChunk *chunk = &chunks[i];
+        result = chunk->result;
+        *lines_read = chunk->lines_read;
+        chunk->word_offset = image->len;
+        chunk->segment_offset = segment_count;
+        ObjectSegment start = open;
+        if (chunk->reset) {
+            open = chunk->open;
+            open.offset += image->len;
+        }
+        chunk->open = start;
+        image->len += chunk->words;
+        segment_count += chunk->ends;
+    }
+    if (result == PS_SUCCESS && chunks[thread_count - 1].next_address != -1)
+        result = PS_NO_END;
+    if (result != PS_SUCCESS)
+        goto free_chunks;
+
+    image->segment_len = segment_count;
+    image->words = arena_alloc(arena, sizeof(uint16_t) * image->len);
+    image->segments = arena_alloc(arena, sizeof(ObjectSegment) * image->segment_len);
+    size_t reserved_len = (image->len + 63) / 64;
+    image->reserved = arena_alloc(arena, sizeof(uint64_t) * reserved_len);
+    memset(image->reserved, 0, sizeof(uint64_t) * reserved_len);
+    if (thread_count == 1)
+        encode_chunk(&chunks[0]);
+    else
+        run_encode_chunks(chunks, thread_count, encode_chunk);
+
+free_chunks:
+    for (size_t i = 0; i < thread_count; i++)
+        arena_free(&chunks[i].arena);
+    return result;
+}
+
+// two hex digits for every byte value
+const char HEX_PAIRS[] =
+    "000102030405060708090A0B0C0D0E0F101112131415161718191A1B1C1D1E1F"
+    "202122232425262728292A2B2C2D2E2F303132333435363738393A3B3C3D3E3F"
+    "404142434445464748494A4B4C4D4E4F505152535455565758595A5B5C5D5E5F"
+    "606162636465666768696A6B6C6D6E6F707172737475767778797A7B7C7D7E7F"
+    "808182838485868788898A8B8C8D8E8F909192939495969798999A9B9C9D9E9F"
+    "A0A1A2A3A4A5A6A7A8A9AAABACADAEAFB0B1B2B3B4B5B6B7B8B9BABBBCBDBEBF"
+    "C0C1C2C3C4C5C6C7C8C9CACBCCCDCECFD0D1D2D3D4D5D6D7D8D9DADBDCDDDEDF"
+    "E0E1E2E3E4E5E6E7E8E9EAEBECEDEEEFF0F1F2F3F4F5F6F7F8F9FAFBFCFDFEFF";
+
+// writes the word as 4 hex digits and a newline
+char *put_hex_line(char *out, uint16_t word) {
+    memcpy(out, &HEX_PAIRS[(word >> 8) * 2], 2);
+    memcpy(out + 2, &HEX_PAIRS[(word & 0xFF) * 2], 2);
+    out[4] = '\n';
+    return out + 5;
+}
+
+bool write_buffer(const char *file_name, const void *buffer, size_t len) {
+    FILE *file = fopen(file_name, "wb");
+    if (file == NULL)
+        return false;
+    bool success = fwrite(buffer, 1, len, file) == len;
+    return fclose(file) == 0 && success;
+}
+
+#define TEXT_OBJ_HEADER "LC-3 OBJ FILE\n\n.TEXT\n"
+
+bool write_to_object(const ObjectImage *image, char *file_name) {
+    // every word is "XXXX\n", and each segment adds its origin and a decimal length of at most 5 digits
+    size_t cap = sizeof(TEXT_OBJ_HEADER) + image->len * 5 + image->segment_len * 11;
+    char *buffer = malloc(cap);
+    if (!buffer)
+        return false;
+    char *out = buffer;
+    memcpy(out, TEXT_OBJ_HEADER, sizeof(TEXT_OBJ_HEADER) - 1);
+    out += sizeof(TEXT_OBJ_HEADER) - 1;
+
+    for (size_t i = 0; i < image->segment_len; i++) {
+        const ObjectSegment *segment = &image->segments[i];
+        out = put_hex_line(out, segment->origin);
+        out += sprintf(out, "%u\n", segment->len);
+        for (size_t word = segment->offset; word < segment->offset + segment->len; word++) {
+            if ((image->reserved[word / 64] >> (word % 64)) & 1) {
+                memcpy(out, "????\n", 5);
+                out += 5;
+            } else
+                out = put_hex_line(out, image->words[word]);
+        }
+    }
+
+    bool success = write_buffer(file_name, buffer, out - buffer);
+    free(buffer);
+    return success;
+}
+
+bool write_to_binary_object(const ObjectImage *image, char *file_name) {
+    if (image->segment_len > 0xFFFF)
+        return false;
+    for (size_t i = 0; i < image->segment_len; i++) {
+        if (image->segments[i].len > 0xFFFF)
+            return false;
+    }
+
+    size_t header_words = BIN_OBJ_HEADER_WORDS + image->segment_len * 2;
+    uint16_t *words = malloc(sizeof(uint16_t) * (header_words + image->len));
+    if (!words)
+        return false;
+    memcpy(words, BIN_OBJ_MAGIC, 4);
+    words[2] = BE16(BIN_OBJ_VERSION);
+    words[3] = BE16(image->segment_len);
+    for (size_t i = 0; i < image->segment_len; i++) {
+        words[BIN_OBJ_HEADER_WORDS + i * 2] = BE16(image->segments[i].origin);
+        words[BIN_OBJ_HEADER_WORDS + i * 2 + 1] = BE16(image->segments[i].len);
+    }
+    // segments are stored back to back in the image already, so the words can go out as is
+    for (size_t i = 0; i < image->len; i++)
+        words[header_words + i] = BE16(image->words[i]);
 
-    free(offsets.offsets);
-    fclose(file);
-    return true;
+    bool success = write_buffer(file_name, words, sizeof(uint16_t) * (header_words + image->len));
+    free(words);
+    return success;
 }
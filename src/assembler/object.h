@@ -1,5 +1,59 @@
 #pragma once
 
+#include <stdint.h>
+
+#include "../arena.h"
 #include "parser.h"
 
-bool write_to_object(const Instructions *instructions, char *file_name);
+typedef struct {
+    uint16_t origin;
+    uint32_t len;   // a segment can fill all of memory, one more word than fits in 16 bits
+    size_t offset;  // index of the segment's first word in ObjectImage.words
+} ObjectSegment;
+
+// encoded program with every segment's words back to back
+typedef struct {
+    uint16_t *words;
+    size_t len;
+    ObjectSegment *segments;
+    size_t segment_len;
+    // one bit per word, set for words reserved by .BLKW. those words are 0 in words
+    uint64_t *reserved;
+} ObjectImage;
+
+// binary objects are made of big endian words: the magic and version, the segment count, a table of (origin, length)
+// for each segment, and then every segment's words back to back. .BLKW words are written as 0. lengths and the count
+// are 16 bits, so an image with a segment filling all of memory can only be written as text
+#define BIN_OBJ_MAGIC "LC3B"
+#define BIN_OBJ_VERSION 1
+#define BIN_OBJ_HEADER_WORDS 4
+
+uint16_t encode_instruction(const Instruction *instr);
+
+void object_image_size(const Instructions *instructions, size_t *word_count, size_t *segment_count);
+
+// out needs room for word_count words, segments for segment_count entries, and reserved for (word_count + 63) / 64
+// zeroed entries, using the counts from object_image_size
+void encode_instructions(const Instructions *instructions,
+                         uint16_t *out,
+                         ObjectSegment *segments,
+                         uint64_t *reserved);
+
+// sizes, allocates and encodes the image in arena
+void encode_object_image(Arena *arena, ObjectImage *image, const Instructions *instructions);
+
+// lines per thread below which starting the thread costs more than it saves
+#define ENCODE_CHUNK_LINES 16384
+
+// parses the lines and encodes them straight into image in arena, with big sources split across threads. symbol_table
+// has to come from generate_symbol_table, which gives every line its address. the result and lines_read are the same
+// as parse_instructions, and the image the same as encode_object_image would make from its instructions
+ParserResult encode_source(Arena *arena,
+                           ObjectImage *image,
+                           const LineTokensList *token_list,
+                           const SymbolTable *symbol_table,
+                           size_t *lines_read);
+
+bool write_to_object(const ObjectImage *image, char *file_name);
+
+bool write_to_binary_object(const ObjectImage *image, char *file_name);
@@ -22,46 +22,109 @@
             return PS_BAD_TOKEN;   \
     } while (0)
 
-#define EXPECT_CALC_OFFSET(bits)                                                                   \
-    do {                                                                                           \
-        ADVANCE_TOKEN;                                                                             \
-        if (token->type == NUMBER)                                                                 \
-            calc_offset = token->data.number;                                                      \
-        else if (token->type == TEXT) {                                                            \
-            if (!symbol_table_get(symbol_table, token->span_start, token->span_len, &calc_offset)) \
-                return PS_SYMBOL_NOT_PRESENT;                                                      \
-            calc_offset -= next_address;                                                           \
-        } else                                                                                     \
-            return PS_BAD_TOKEN;                                                                   \
-        if (!fit_to_bits(calc_offset, bits, &temp_instr.data.offset))                              \
-            return PS_NUMBER_TOO_LARGE;                                                            \
+#define EXPECT_CALC_OFFSET(bits)                                                                           \
+    do {                                                                                                   \
+        ADVANCE_TOKEN;                                                                                     \
+        if (token->type == NUMBER)                                                                         \
+            calc_offset = token->data.number;                                                              \
+        else if (token->type == TEXT) {                                                                    \
+            if (!symbol_table_get(symbol_table, token->span_start, token->span_len, &calc_offset)) {       \
+                if (!fixups)                                                                               \
+                    return PS_SYMBOL_NOT_PRESENT;                                                          \
+                add_fixup(arena, fixups, token, instrs->len, line_tokens->line, next_address, bits);       \
+                calc_offset = next_address;                                                                \
+            }                                                                                              \
+            calc_offset -= next_address;                                                                   \
+        } else                                                                                             \
+            return PS_BAD_TOKEN;                                                                           \
+        if (!fit_to_bits(calc_offset, bits, &temp_instr.data.offset))                                      \
+            return PS_NUMBER_TOO_LARGE;                                                                    \
     } while (0)
 
-void add_instruction(Instructions *instrs, size_t *instrs_cap, Instruction instr) {
-    if (instrs->len == *instrs_cap)
-        instrs->instructions = realloc(instrs->instructions, sizeof(Instruction) * (*instrs_cap *= 2));
+// a label operand that wasn't defined yet when its instruction was parsed
+typedef struct {
+    const char *span_start;
+    size_t span_len;
+    size_t instr;  // index into Instructions
+    size_t line;
+    int32_t pc_base;  // subtracted from the label's address, 0 for absolute addresses
+    uint8_t bits;
+} Fixup;
+
+typedef struct {
+    Fixup *fixups;
+    size_t len;
+    size_t cap;
+} Fixups;
+
+void add_fixup(Arena *arena,
+               Fixups *fixups,
+               const Token *token,
+               size_t instr,
+               size_t line,
+               int32_t pc_base,
+               uint8_t bits) {
+    if (fixups->len == fixups->cap) {
+        size_t cap = fixups->cap ? fixups->cap * 2 : 16;
+        fixups->fixups = arena_grow(arena, fixups->fixups, sizeof(Fixup) * fixups->cap, sizeof(Fixup) * cap);
+        fixups->cap = cap;
+    }
+    fixups->fixups[fixups->len++] = (Fixup){
+        .span_start = token->span_start,
+        .span_len = token->span_len,
+        .instr = instr,
+        .line = line,
+        .pc_base = pc_base,
+        .bits = bits,
+    };
+}
+
+void add_instruction(Arena *arena, Instructions *instrs, size_t *instrs_cap, Instruction instr) {
+    if (instrs->len == *instrs_cap) {
+        instrs->instructions = arena_grow(arena, instrs->instructions, sizeof(Instruction) * *instrs_cap,
+                                          sizeof(Instruction) * *instrs_cap * 2);
+        *instrs_cap *= 2;
+    }
     instrs->instructions[instrs->len++] = instr;
 }
 
-#define PUSH_CONTINUE(i_instr)                         \
-    do {                                               \
-        add_instruction(instrs, &instrs_cap, i_instr); \
-        goto continue_lines;                           \
+#define PUSH_CONTINUE(i_instr)                                \
+    do {                                                      \
+        add_instruction(arena, instrs, &instrs_cap, i_instr); \
+        goto continue_lines;                                  \
     } while (0)
 
-ParserResult parse_instructions(Instructions *instrs,
-                                const LineTokensList *token_list,
-                                const SymbolTable *symbol_table,
-                                size_t *lines_read) {
-    *lines_read = 0;
-    int32_t next_address = -1;
-    size_t instrs_cap = 50;
+// with a null fixups, every label has to already be in symbol_table. otherwise labels are defined into new_symbols
+// (which is symbol_table) as they're reached, and references to ones that aren't defined yet are recorded in fixups.
+// parses count lines from first. address is where the first one starts, -1 outside a section, and is left where the
+// last one ends. only a range starting outside a section can define labels
+ParserResult parse_lines(Arena *arena,
+                         Instructions *instrs,
+                         const LineTokensList *token_list,
+                         const SymbolTable *symbol_table,
+                         SymbolTable *new_symbols,
+                         Fixups *fixups,
+                         size_t first,
+                         size_t count,
+                         int32_t *address,
+                         size_t *lines_read) {
+    *lines_read = first;
+    int32_t next_address = *address, orig_address = 0;
+    // about one instruction per line
+    size_t instrs_cap = count + 1;
     instrs->len = 0;
-    instrs->instructions = malloc(sizeof(Instruction) * instrs_cap);
+    instrs->instructions = arena_alloc(arena, sizeof(Instruction) * instrs_cap);
 
-    for (size_t line = 0; line < token_list->len; line++) {
+    for (size_t line = first; line < first + count; line++) {
         (*lines_read)++;
         LineTokens *line_tokens = &token_list->line_tokens[line];
+        // where the line leaves the address comes from the same summary the symbol pass uses. the errors are still
+        // the parser's own, it checks everything the summary does
+        LineSummary summary;
+        summarize_line(line_tokens, &summary);
+        int32_t line_address = next_address;
+        if (line_address != -1 && summary.kind == LINE_WORDS)
+            next_address += summary.words;
         size_t i;
         for (i = 0; i < line_tokens->len; i++) {
             Token *token = &line_tokens->tokens[i];
@@ -71,53 +134,36 @@ ParserResult parse_instructions(Instructions *instrs,
                 EXPECT_TOKEN(NUMBER);
                 if (token->data.number < 0)
                     return PS_NEGATIVE_ORIG;
-                next_address = token->data.number;
+                orig_address = next_address = summary.words;
                 if (i + 1 < line_tokens->len)
                     return PS_TRAILING_TOKENS;
                 PUSH_CONTINUE(((Instruction){.type = INSTR_ORIG, .data.u16 = token->data.number}));
             }
 
-            switch (token->type) {
-                case TEXT:
-                case BLKW:
-                case STRINGZ:
-                case ORIG:
-                case END:
-                    break;
-                default:
-                    next_address++;
-            }
-
             Instruction temp_instr;
             int32_t calc_offset;
             switch (token->type) {
                 case TEXT:
+                    if (new_symbols &&
+                        symbol_table_add(new_symbols, token->span_start, token->span_len, line_address) != ST_SUCCESS)
+                        return PS_SYMBOL_ALREADY_EXISTS;
                     continue;
                 case BLKW:
                     EXPECT_TOKEN(NUMBER);
                     if (token->data.number <= 0)
                         return PS_BAD_BLKW;
-                    next_address += token->data.number;
                     PUSH_CONTINUE(((Instruction){.type = INSTR_BLKW, .data = {.u16 = token->data.number}}));
                 case STRINGZ:
                     temp_instr = (Instruction){.type = INSTR_STRINGZ};
                     EXPECT_TOKEN(QUOTE);
                     EXPECT_TOKEN(TEXT);
-                    temp_instr.data.text = token->span_start;
-                    temp_instr.data.text_len = token->span_len;
-                    char *unescaped;
-                    size_t output_len;
-                    UnescapeResult result =
-                        unescape_string(token->span_start, token->span_len, &unescaped, &output_len);
-                    if (result == US_INVALID_ESCAPE)
-                        return PS_BAD_STRING_ESCAPE;
-                    size_t len = (result == US_ALLOC) ? output_len : token->span_len;
-                    next_address += len + 1;  // + 1 from null terminator
-                    if (result == US_ALLOC)
-                        free(unescaped);
+                    temp_instr.data.text = token->data.string.text;
+                    temp_instr.data.text_len = token->data.string.text_len;
                     EXPECT_TOKEN(QUOTE);
                     PUSH_CONTINUE(temp_instr);
                 case END:
+                    if (new_symbols && symbol_table_add_span(new_symbols, orig_address, line_address - 1) != ST_SUCCESS)
+                        return PS_OVERLAPPING_MEM;
                     next_address = -1;
                     PUSH_CONTINUE(((Instruction){.type = INSTR_END}));
                 case ADD:
@@ -258,6 +304,8 @@ ParserResult parse_instructions(Instructions *instrs,
                     PUSH_CONTINUE(((Instruction){.type = INSTR_TRAP, .data.u16 = 0x22}));
                 case IN:
                     PUSH_CONTINUE(((Instruction){.type = INSTR_TRAP, .data.u16 = 0x23}));
+                case PUTSP:
+                    PUSH_CONTINUE(((Instruction){.type = INSTR_TRAP, .data.u16 = 0x24}));
                 case HALT:
                     PUSH_CONTINUE(((Instruction){.type = INSTR_TRAP, .data.u16 = 0x25}));
                 case FILL:
@@ -267,9 +315,12 @@ ParserResult parse_instructions(Instructions *instrs,
                         // tokenizer guarantees ints are within a 16 bit range
                         temp_instr.data.u16 = token->data.number;
                     } else if (token->type == TEXT) {
-                        if (!symbol_table_get(symbol_table, token->span_start, token->span_len, &calc_offset))
+                        if (symbol_table_get(symbol_table, token->span_start, token->span_len, &calc_offset))
+                            temp_instr.data.u16 = calc_offset;
+                        else if (fixups)
+                            add_fixup(arena, fixups, token, instrs->len, line_tokens->line, 0, 16);
+                        else
                             return PS_SYMBOL_NOT_PRESENT;
-                        temp_instr.data.u16 = calc_offset;
                     } else
                         return PS_BAD_TOKEN;
                     PUSH_CONTINUE(temp_instr);
@@ -284,5 +335,63 @@ ParserResult parse_instructions(Instructions *instrs,
             return PS_OVERFLOWING_ADDR;
     }
 
+    *address = next_address;
+    return PS_SUCCESS;
+}
+
+ParserResult parse_instructions(Arena *arena,
+                                Instructions *instrs,
+                                const LineTokensList *token_list,
+                                const SymbolTable *symbol_table,
+                                size_t *lines_read) {
+    int32_t next_address = -1;
+    ParserResult result =
+        parse_lines(arena, instrs, token_list, symbol_table, NULL, NULL, 0, token_list->len, &next_address, lines_read);
+    return result == PS_SUCCESS && next_address != -1 ? PS_NO_END : result;
+}
+
+ParserResult parse_instruction_range(Arena *arena,
+                                     Instructions *instrs,
+                                     const LineTokensList *token_list,
+                                     const SymbolTable *symbol_table,
+                                     size_t first,
+                                     size_t count,
+                                     int32_t *next_address,
+                                     size_t *lines_read) {
+    return parse_lines(arena, instrs, token_list, symbol_table, NULL, NULL, first, count, next_address, lines_read);
+}
+
+ParserResult parse_instructions_single_pass(Arena *arena,
+                                            Instructions *instrs,
+                                            SymbolTable *symbol_table,
+                                            const LineTokensList *token_list,
+                                            size_t *lines_read) {
+    symbol_table_init(arena, symbol_table);
+    Fixups fixups = {0};
+    int32_t next_address = -1;
+    ParserResult result = parse_lines(arena, instrs, token_list, symbol_table, symbol_table, &fixups, 0, token_list->len,
+                                      &next_address, lines_read);
+    if (result != PS_SUCCESS)
+        return result;
+    if (next_address != -1)
+        return PS_NO_END;
+
+    // every label is known now, so patch the fields that were left for later
+    for (size_t i = 0; i < fixups.len; i++) {
+        Fixup *fixup = &fixups.fixups[i];
+        Instruction *instr = &instrs->instructions[fixup->instr];
+        int32_t addr;
+        if (!symbol_table_get(symbol_table, fixup->span_start, fixup->span_len, &addr)) {
+            *lines_read = fixup->line;
+            return PS_SYMBOL_NOT_PRESENT;
+        }
+        if (fixup->bits == 16)
+            instr->data.u16 = addr;
+        else if (!fit_to_bits(addr - fixup->pc_base, fixup->bits, &instr->data.offset)) {
+            *lines_read = fixup->line;
+            return PS_NUMBER_TOO_LARGE;
+        }
+    }
+
     return PS_SUCCESS;
 }
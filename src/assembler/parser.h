@@ -1,6 +1,8 @@
 #pragma once
 
 #include <stdint.h>
+
+#include "../arena.h"
 #include "symbol.h"
 #include "token.h"
 
@@ -30,7 +32,7 @@ typedef enum {
     INSTR_END,
 } InstructionType;
 
-// has the lifetime of the text used to create it
+// has the lifetime of the text and arena used to create it
 typedef struct {
     union InstructionData {
         struct {
@@ -47,6 +49,7 @@ typedef struct {
             };
         };
         uint16_t u16;
+        // .STRINGZ text with escapes decoded, not including the null terminator
         struct {
             const char *text;
             size_t text_len;
@@ -67,14 +70,37 @@ typedef enum {
     PS_BAD_TOKEN,
     PS_NEGATIVE_ORIG,
     PS_BAD_BLKW,
-    PS_BAD_STRING_ESCAPE,
     PS_TRAILING_TOKENS,
     PS_NUMBER_TOO_LARGE,
     PS_SYMBOL_NOT_PRESENT,
     PS_OVERFLOWING_ADDR,
+    PS_SYMBOL_ALREADY_EXISTS,
+    PS_OVERLAPPING_MEM,
+    PS_NO_END,
 } ParserResult;
 
-ParserResult parse_instructions(Instructions *instructions,
+// everything is allocated in arena
+ParserResult parse_instructions(Arena *arena,
+                                Instructions *instructions,
                                 const LineTokensList *line_tokens,
                                 const SymbolTable *symbol_table,
                                 size_t *lines_read);
+
+// parses count lines from first, with every label already in symbol_table. next_address is the address the first line
+// starts at, -1 outside a section, and it's left where the last line ends. a range that ends inside a section is fine
+ParserResult parse_instruction_range(Arena *arena,
+                                     Instructions *instrs,
+                                     const LineTokensList *token_list,
+                                     const SymbolTable *symbol_table,
+                                     size_t first,
+                                     size_t count,
+                                     int32_t *next_address,
+                                     size_t *lines_read);
+
+// builds symbol_table while parsing instead of needing generate_symbol_table first. references to labels defined
+// later are patched in once the whole source has been read
+ParserResult parse_instructions_single_pass(Arena *arena,
+                                            Instructions *instructions,
+                                            SymbolTable *symbol_table,
+                                            const LineTokensList *line_tokens,
+                                            size_t *lines_read);
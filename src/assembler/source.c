@@ -0,0 +1,104 @@
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include "source.h"
+#include "token.h"
+
+typedef struct {
+    SourceLine *lines;
+    size_t len;
+    size_t cap;
+} SourceLines;
+
+void push_line(SourceLines *lines, const char *start, const char *end) {
+    // drop the \r from \r\n line endings
+    if (end > start && end[-1] == '\r')
+        end--;
+    if (lines->len == lines->cap)
+        lines->lines = realloc(lines->lines, sizeof(SourceLine) * (lines->cap *= 2));
+    lines->lines[lines->len++] = (SourceLine){.start = start, .len = end - start};
+}
+
+void split_lines(SourceFile *source) {
+    SourceLines lines = {.lines = malloc(sizeof(SourceLine) * 64), .len = 0, .cap = 64};
+    const char *text = source->text, *end = source->text + source->len;
+    const char *line_start = text;
+    const char *cur = text;
+
+#ifdef __SSE2__
+    // compare 16 bytes at a time against \n and walk the set bits of the match mask
+    const __m128i newline = _mm_set1_epi8('\n');
+    for (; end - cur >= 16; cur += 16) {
+        uint32_t mask = _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)cur), newline));
+        while (mask) {
+            const char *found = cur + __builtin_ctz(mask);
+            push_line(&lines, line_start, found);
+            line_start = found + 1;
+            mask &= mask - 1;
+        }
+    }
+#endif
+
+    const char *found;
+    while ((found = memchr(cur, '\n', end - cur))) {
+        push_line(&lines, line_start, found);
+        line_start = cur = found + 1;
+    }
+
+    // the last line doesn't need a trailing newline
+    if (line_start != end)
+        push_line(&lines, line_start, end);
+
+    source->lines = lines.lines;
+    source->line_count = lines.len;
+}
+
+SourceFileResult source_file_open(SourceFile *source, const char *file_name) {
+    int fd = open(file_name, O_RDONLY);
+    if (fd == -1)
+        return SF_OPEN_FAILED;
+
+    struct stat st;
+    if (fstat(fd, &st) == -1) {
+        close(fd);
+        return SF_OPEN_FAILED;
+    }
+
+    *source = (SourceFile){.text = "", .len = st.st_size};
+    // mmap can't map an empty file
+    if (source->len != 0) {
+        void *text = mmap(NULL, source->len, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (text == MAP_FAILED) {
+            close(fd);
+            return SF_MAP_FAILED;
+        }
+        madvise(text, source->len, MADV_SEQUENTIAL);
+        source->text = text;
+        source->mapped = true;
+    }
+    // the mapping stays valid after the descriptor is closed
+    close(fd);
+
+    split_lines(source);
+    return SF_SUCCESS;
+}
+
+void source_file_from_text(SourceFile *source, const char *text, size_t len) {
+    *source = (SourceFile){.text = text, .len = len};
+    split_lines(source);
+}
+
+void source_file_close(SourceFile *source) {
+    if (source->mapped)
+        munmap((void *)source->text, source->len);
+    free(source->lines);
+}
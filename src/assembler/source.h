@@ -0,0 +1,29 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "token.h"
+
+// source text split into lines. tokens, symbols and instructions all point into text, so it has to outlive them
+typedef struct {
+    const char *text;
+    size_t len;
+    SourceLine *lines;
+    size_t line_count;
+    bool mapped;
+} SourceFile;
+
+typedef enum {
+    SF_SUCCESS,
+    SF_OPEN_FAILED,
+    SF_MAP_FAILED,
+} SourceFileResult;
+
+// maps the file read only and splits it into lines without copying any of the text
+SourceFileResult source_file_open(SourceFile *source, const char *file_name);
+
+// splits text that's already in memory, which has to outlive the source
+void source_file_from_text(SourceFile *source, const char *text, size_t len);
+
+void source_file_close(SourceFile *source);
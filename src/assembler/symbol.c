@@ -1,3 +1,6 @@
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
 #include <stddef.h>
 #include <stdint.h>
 #include <stdio.h>
@@ -16,138 +19,452 @@
         token = &line_tokens->tokens[++i]; \
     } while (0)
 
-SymbolTableResult add_symbol(SymbolTable *table, size_t *table_cap, char *symbol, int32_t cur_address) {
+uint32_t hash_symbol(const char *span_start, size_t span_len) {
+    // FNV-1a over the case folded text
+    uint32_t hash = 2166136261u;
+    for (size_t i = 0; i < span_len; i++)
+        hash = (hash ^ (uint8_t)(span_start[i] & 0xDF)) * 16777619u;
+    return hash;
+}
+
+// returns the slot holding the symbol, or the empty slot it would be inserted into
+uint32_t *find_slot(const SymbolTable *table, const char *span_start, size_t span_len, uint32_t hash) {
+    for (size_t i = hash & table->slot_mask;; i = (i + 1) & table->slot_mask) {
+        uint32_t *slot = &table->slots[i];
+        if (*slot == 0)
+            return slot;
+        const Symbol *symbol = &table->symbols[*slot - 1];
+        if (symbol->hash == hash && symbol->span_len == span_len &&
+            strncasecmp(symbol->span_start, span_start, span_len) == 0)
+            return slot;
+    }
+}
+
+void grow_slots(SymbolTable *table) {
+    table->slot_mask = table->slot_mask * 2 + 1;
+    table->slots = arena_alloc(table->arena, sizeof(uint32_t) * (table->slot_mask + 1));
+    memset(table->slots, 0, sizeof(uint32_t) * (table->slot_mask + 1));
     for (size_t i = 0; i < table->sym_len; i++) {
-        if (strcasecmp(table->symbols[i].symbol, symbol) == 0)
-            return ST_SYMBOL_ALREADY_EXISTS;
+        const Symbol *symbol = &table->symbols[i];
+        *find_slot(table, symbol->span_start, symbol->span_len, symbol->hash) = i + 1;
+    }
+}
+
+SymbolTableResult symbol_table_add(SymbolTable *table, const char *span_start, size_t span_len, int32_t cur_address) {
+    uint32_t hash = hash_symbol(span_start, span_len);
+    uint32_t *slot = find_slot(table, span_start, span_len, hash);
+    if (*slot != 0)
+        return ST_SYMBOL_ALREADY_EXISTS;
+
+    if (table->sym_len == table->sym_cap) {
+        table->symbols =
+            arena_grow(table->arena, table->symbols, sizeof(Symbol) * table->sym_cap, sizeof(Symbol) * table->sym_cap * 2);
+        table->sym_cap *= 2;
     }
+    table->symbols[table->sym_len++] =
+        (Symbol){.span_start = span_start, .span_len = span_len, .hash = hash, .addr = cur_address};
+    *slot = table->sym_len;
 
-    if (table->sym_len == *table_cap)
-        table->symbols = realloc(table->symbols, sizeof(*table->symbols) * (*table_cap *= 2));
-    table->symbols[table->sym_len].symbol = symbol;
-    table->symbols[table->sym_len++].addr = cur_address;
+    // keep the load factor at or under 1/2 so probe sequences stay short
+    if (table->sym_len * 2 > table->slot_mask)
+        grow_slots(table);
 
     return ST_SUCCESS;
 }
 
-bool addr_spans_contains_addr(const SymbolTable *table, int32_t addr) {
-    // don't need to check the current table addr spans since it's not filled out
-    for (size_t i = 0; i + 1 < table->addr_len; i++) {
-        if (addr >= table->addr_spans[i].orig_addr && addr <= table->addr_spans[i].end_addr)
-            return true;
+// index of the first span starting after addr
+size_t addr_spans_upper_bound(const SymbolTable *table, int32_t addr) {
+    size_t lo = 0, hi = table->addr_len;
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        if (table->addr_spans[mid].orig_addr <= addr)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return lo;
+}
+
+SymbolTableResult symbol_table_add_span(SymbolTable *table, int32_t orig_addr, int32_t end_addr) {
+    if (end_addr < orig_addr)
+        return ST_SUCCESS;
+
+    size_t i = addr_spans_upper_bound(table, orig_addr);
+    // spans are disjoint and sorted, so only the neighbors on either side can overlap
+    if (i > 0 && table->addr_spans[i - 1].end_addr >= orig_addr)
+        return ST_OVERLAPPING_MEM;
+    if (i < table->addr_len && table->addr_spans[i].orig_addr <= end_addr)
+        return ST_OVERLAPPING_MEM;
+
+    if (table->addr_len == table->addr_cap) {
+        table->addr_spans = arena_grow(table->arena, table->addr_spans, sizeof(*table->addr_spans) * table->addr_cap,
+                                       sizeof(*table->addr_spans) * table->addr_cap * 2);
+        table->addr_cap *= 2;
     }
-    return false;
+    memmove(&table->addr_spans[i + 1], &table->addr_spans[i], sizeof(*table->addr_spans) * (table->addr_len - i));
+    table->addr_spans[i].orig_addr = orig_addr;
+    table->addr_spans[i].end_addr = end_addr;
+    table->addr_len++;
+    return ST_SUCCESS;
 }
 
-SymbolTableResult generate_symbol_table(SymbolTable *table, const LineTokensList *token_list, size_t *lines_read) {
-    *lines_read = 0;
-    int32_t next_address = -1;
-    size_t table_cap = 5, addr_cap = 5;
+void symbol_table_init(Arena *arena, SymbolTable *table) {
+    table->arena = arena;
     table->sym_len = 0;
+    table->sym_cap = 16;
+    table->symbols = arena_alloc(arena, sizeof(Symbol) * table->sym_cap);
+    table->slot_mask = 31;
+    table->slots = arena_alloc(arena, sizeof(uint32_t) * (table->slot_mask + 1));
+    memset(table->slots, 0, sizeof(uint32_t) * (table->slot_mask + 1));
     table->addr_len = 0;
-    table->symbols = malloc(sizeof(*table->symbols) * table_cap);
-    table->addr_spans = malloc(sizeof(*table->addr_spans) * addr_cap);
-
-    for (size_t line = 0; line < token_list->len; line++) {
-        (*lines_read)++;
-        LineTokens *line_tokens = &token_list->line_tokens[line];
-        for (size_t i = 0; i < line_tokens->len; i++) {
-            Token *token = &line_tokens->tokens[i];
-            if (next_address == -1) {
-                if (token->type != ORIG)
-                    return ST_TOKEN_BEFORE_ORIG;
-                ADVANCE_TOKEN;
-                if (token->type != NUMBER)
-                    return ST_NO_ORIG_NUMBER;
-                if (token->data.number < 0)
-                    return ST_NEGATIVE_ORIG;
-
-                next_address = token->data.number;
-                if (table->addr_len == addr_cap)
-                    table->addr_spans = realloc(table->addr_spans, sizeof(*table->addr_spans) * (addr_cap *= 2));
-                table->addr_spans[table->addr_len++].orig_addr = next_address;
-                goto continue_lines;
-            }
+    table->addr_cap = 5;
+    table->addr_spans = arena_alloc(arena, sizeof(*table->addr_spans) * table->addr_cap);
+    table->line_addrs = NULL;
+}
+
+// lines per thread below which starting the thread costs more than it saves
+#define SYMBOL_CHUNK_LINES 16384
+
+// a .orig/.end section closed by the line at index line
+typedef struct {
+    int32_t orig_addr;
+    int32_t end_addr;
+    size_t line;
+} SectionEnd;
+
+// a run of lines the pass hands to one thread
+typedef struct {
+    pthread_t thread;
+    bool threaded;  // false if the thread couldn't be created and the step ran on the caller's
+    const LineTokensList *token_list;
+    SymbolTable *table;
+    LineSummary *summaries;
+    size_t first;
+    size_t count;
+    // the first step counts what the chunk adds and works out the section it leaves off in as if it started inside
+    // one at address 0. next_address is -1 when that's outside a section
+    size_t labels;
+    size_t ends;  // and in the third step, how many of them it got to
+    bool reset;   // whether there's a .orig or .end, after which the start no longer matters
+    int32_t next_address;
+    int32_t orig_address;
+    // the second step fills in where the chunk really starts and where its labels and sections go
+    int32_t start_next;
+    int32_t start_orig;
+    size_t label_offset;
+    size_t *label_lines;
+    SectionEnd *section_ends;
+    // the third step finds the first error in the chunk, and the first label that was already defined
+    SymbolTableResult result;
+    size_t error_line;
+    uint32_t duplicate;  // 1 based index into symbols, 0 without one
+} SymbolChunk;
+
+SymbolTableResult summarize_line(const LineTokens *line_tokens, LineSummary *summary) {
+    *summary = (LineSummary){.kind = line_tokens->len ? LINE_WORDS : LINE_EMPTY};
+    if (line_tokens->len == 0)
+        return ST_SUCCESS;
+
+    size_t i = 0;
+    Token *token = &line_tokens->tokens[0];
+    if (token->type == ORIG) {
+        summary->kind = LINE_ORIG;
+        ADVANCE_TOKEN;
+        if (token->type != NUMBER)
+            return ST_NO_ORIG_NUMBER;
+        if (token->data.number < 0)
+            return ST_NEGATIVE_ORIG;
+        summary->words = token->data.number;
+        return ST_SUCCESS;
+    }
+
+    while (token->type == TEXT) {
+        summary->labels++;
+        if (i + 1 == line_tokens->len)
+            return ST_SUCCESS;
+        token = &line_tokens->tokens[++i];
+    }
+    switch (token->type) {
+        case ORIG:
+            return ST_ORIG_INSIDE_ORIG;
+        case END:
+            summary->kind = LINE_END;
+            return ST_SUCCESS;
+        case STRINGZ:
+            ADVANCE_TOKEN;
+            if (token->type != QUOTE)
+                return ST_BAD_STRINGZ;
+            ADVANCE_TOKEN;
+            if (token->type != TEXT)
+                return ST_BAD_STRINGZ;
+            summary->words = token->data.string.text_len + 1;  // + 1 from null terminator
+            ADVANCE_TOKEN;
+            if (token->type != QUOTE)
+                return ST_BAD_STRINGZ;
+            return ST_SUCCESS;
+        case BLKW:
+            ADVANCE_TOKEN;
+            if (token->type != NUMBER)
+                return ST_NO_BLKW_AMOUNT;
+            if (token->data.number <= 0)
+                return ST_BAD_BLKW_AMOUNT;
+            summary->words = token->data.number;
+            return ST_SUCCESS;
+        default:
+            summary->words = 1;
+            return ST_SUCCESS;
+    }
+}
+
+void *summarize_chunk(void *arg) {
+    SymbolChunk *chunk = arg;
+    int32_t next_address = 0, orig_address = 0;
+    for (size_t line = chunk->first; line < chunk->first + chunk->count; line++) {
+        LineSummary *summary = &chunk->summaries[line];
+        summary->result = summarize_line(&chunk->token_list->line_tokens[line], summary);
+        // errors are found in the third step, until then every line is taken to be where it's allowed
+        switch (summary->kind) {
+            case LINE_EMPTY:
+                break;
+            case LINE_ORIG:
+                chunk->reset = true;
+                orig_address = next_address = summary->words;
+                break;
+            case LINE_END:
+                chunk->reset = true;
+                chunk->labels += summary->labels;
+                chunk->ends++;
+                next_address = -1;
+                break;
+            case LINE_WORDS:
+                chunk->labels += summary->labels;
+                if (next_address != -1)
+                    next_address += summary->words;
+                break;
+        }
+    }
+    chunk->next_address = next_address;
+    chunk->orig_address = orig_address;
+    return NULL;
+}
 
-            if (addr_spans_contains_addr(table, next_address))
-                return ST_OVERLAPPING_MEM;
-
-            switch (token->type) {
-                case TEXT:;
-                    char *symbol = strndup(token->span_start, token->span_len);
-                    if (add_symbol(table, &table_cap, symbol, next_address) != ST_SUCCESS) {
-                        free(symbol);
-                        return ST_SYMBOL_ALREADY_EXISTS;
-                    }
-                    break;
-                case ORIG:
-                    return ST_ORIG_INSIDE_ORIG;
-                case END:
-                    table->addr_spans[table->addr_len - 1].end_addr = next_address - 1;
-                    next_address = -1;
-                    goto continue_lines;
-                case STRINGZ:
-                    ADVANCE_TOKEN;
-                    if (token->type != QUOTE)
-                        return ST_BAD_STRINGZ;
-                    ADVANCE_TOKEN;
-                    if (token->type != TEXT)
-                        return ST_BAD_STRINGZ;
-
-                    char *unescaped;
-                    size_t output_len;
-                    UnescapeResult result =
-                        unescape_string(token->span_start, token->span_len, &unescaped, &output_len);
-                    if (result == US_INVALID_ESCAPE)
-                        return ST_BAD_STRING_ESCAPE;
-                    size_t len = (result == US_ALLOC) ? output_len : token->span_len;
-                    next_address += len + 1;  // + 1 from null terminator
-                    if (result == US_ALLOC)
-                        free(unescaped);
-
-                    ADVANCE_TOKEN;
-                    if (token->type != QUOTE)
-                        return ST_BAD_STRINGZ;
-                    goto continue_lines;
-                case BLKW:
-                    ADVANCE_TOKEN;
-                    if (token->type != NUMBER)
-                        return ST_NO_BLKW_AMOUNT;
-                    if (token->data.number <= 0)
-                        return ST_BAD_BLKW_AMOUNT;
-                    next_address += token->data.number;
-                    goto continue_lines;
-                default:
-                    next_address++;
-                    goto continue_lines;
+// inserts symbols[index - 1] while other threads insert too. slots only ever go from empty to a symbol, or from a
+// symbol to an earlier one with the same name, so every thread probes the same sequence for a name. returns the index
+// of a later symbol with the same name as an earlier one, or 0 if there wasn't one
+uint32_t symbol_table_insert_concurrent(SymbolTable *table, uint32_t index) {
+    const Symbol *symbol = &table->symbols[index - 1];
+    for (size_t i = symbol->hash & table->slot_mask;; i = (i + 1) & table->slot_mask) {
+        _Atomic uint32_t *slot = (_Atomic uint32_t *)&table->slots[i];
+        uint32_t held = atomic_load_explicit(slot, memory_order_acquire);
+        for (;;) {
+            if (held == 0) {
+                if (atomic_compare_exchange_weak_explicit(slot, &held, index, memory_order_release,
+                                                          memory_order_acquire))
+                    return 0;
+                continue;
             }
+            const Symbol *other = &table->symbols[held - 1];
+            if (other->hash != symbol->hash || other->span_len != symbol->span_len ||
+                strncasecmp(other->span_start, symbol->span_start, symbol->span_len) != 0)
+                break;
+            if (held < index)
+                return index;
+            // a later definition got here first, so it's the duplicate
+            if (atomic_compare_exchange_weak_explicit(slot, &held, index, memory_order_release, memory_order_acquire))
+                return held;
         }
-    continue_lines:;
-        if (addr_spans_contains_addr(table, next_address))
-            return ST_OVERLAPPING_MEM;
     }
+}
 
-    if (next_address != -1)
-        return ST_NO_END;
+#define CHUNK_FAIL(i_result)      \
+    do {                          \
+        chunk->result = i_result; \
+        chunk->error_line = line; \
+        return NULL;              \
+    } while (0)
 
-    return ST_SUCCESS;
+void *assign_chunk(void *arg) {
+    SymbolChunk *chunk = arg;
+    SymbolTable *table = chunk->table;
+    int32_t next_address = chunk->start_next, orig_address = chunk->start_orig;
+    size_t label = chunk->label_offset;
+    chunk->ends = 0;
+    // kept in locals, since the stores below could otherwise alias them and have them loaded again every line
+    int32_t *line_addrs = table->line_addrs;
+    const LineSummary *summaries = chunk->summaries;
+    for (size_t line = chunk->first, end = chunk->first + chunk->count; line < end; line++) {
+        const LineSummary *summary = &summaries[line];
+        line_addrs[line] = next_address;
+        if (summary->kind == LINE_EMPTY)
+            continue;
+        if (summary->kind == LINE_ORIG) {
+            if (next_address != -1)
+                CHUNK_FAIL(ST_ORIG_INSIDE_ORIG);
+            if (summary->result != ST_SUCCESS)
+                CHUNK_FAIL(summary->result);
+            orig_address = next_address = summary->words;
+            continue;
+        }
+        if (next_address == -1)
+            CHUNK_FAIL(ST_TOKEN_BEFORE_ORIG);
+
+        for (size_t i = 0; i < summary->labels; i++) {
+            const Token *tokens = chunk->token_list->line_tokens[line].tokens;
+            table->symbols[label] = (Symbol){.span_start = tokens[i].span_start,
+                                             .span_len = tokens[i].span_len,
+                                             .hash = hash_symbol(tokens[i].span_start, tokens[i].span_len),
+                                             .addr = next_address};
+            chunk->label_lines[label++] = line;
+            uint32_t duplicate = symbol_table_insert_concurrent(table, label);
+            if (duplicate && (!chunk->duplicate || duplicate < chunk->duplicate))
+                chunk->duplicate = duplicate;
+        }
+        if (summary->result != ST_SUCCESS)
+            CHUNK_FAIL(summary->result);
+
+        if (summary->kind == LINE_END) {
+            chunk->section_ends[chunk->ends++] = (SectionEnd){orig_address, next_address - 1, line};
+            next_address = -1;
+        } else
+            next_address += summary->words;
+    }
+    chunk->result = ST_SUCCESS;
+    return NULL;
 }
 
-void free_symbol_table(SymbolTable *table) {
-    for (size_t i = 0; i < table->sym_len; i++)
-        free(table->symbols[i].symbol);
-    free(table->symbols);
-    free(table->addr_spans);
+void run_symbol_chunks(SymbolChunk *chunks, size_t count, void *(*step)(void *)) {
+    // one run has nothing to wait for, so it stays on the caller's thread
+    if (count == 1) {
+        step(&chunks[0]);
+        return;
+    }
+    for (size_t i = 0; i < count; i++) {
+        chunks[i].threaded = pthread_create(&chunks[i].thread, NULL, step, &chunks[i]) == 0;
+        if (!chunks[i].threaded)
+            step(&chunks[i]);
+    }
+    for (size_t i = 0; i < count; i++) {
+        if (chunks[i].threaded)
+            pthread_join(chunks[i].thread, NULL);
+    }
+}
+
+// goes through the lines in three steps over runs of them, one run per thread for big sources and a single run
+// otherwise. first every line is summarized on its own, then a sum over the runs gives the address each one starts
+// at, and then every run assigns its addresses and inserts its labels at once. the first error by line wins, like it
+// would going through the lines in order
+SymbolTableResult generate_symbol_table(Arena *arena,
+                                        SymbolTable *table,
+                                        const LineTokensList *token_list,
+                                        size_t *lines_read) {
+    size_t thread_count = parallel_threads(token_list->len, SYMBOL_CHUNK_LINES);
+    symbol_table_init(arena, table);
+    LineSummary *summaries = arena_alloc(arena, sizeof(LineSummary) * token_list->len);
+    SymbolChunk *chunks = arena_alloc(arena, sizeof(SymbolChunk) * thread_count);
+    for (size_t i = 0; i < thread_count; i++) {
+        size_t first = i * token_list->len / thread_count, end = (i + 1) * token_list->len / thread_count;
+        chunks[i] = (SymbolChunk){
+            .token_list = token_list, .table = table, .summaries = summaries, .first = first, .count = end - first};
+    }
+    run_symbol_chunks(chunks, thread_count, summarize_chunk);
+
+    size_t labels = 0, ends = 0;
+    int32_t next_address = -1, orig_address = 0;
+    for (size_t i = 0; i < thread_count; i++) {
+        SymbolChunk *chunk = &chunks[i];
+        chunk->start_next = next_address;
+        chunk->start_orig = orig_address;
+        chunk->label_offset = labels;
+        labels += chunk->labels;
+        ends += chunk->ends;
+        if (chunk->reset) {
+            next_address = chunk->next_address;
+            orig_address = chunk->orig_address;
+        } else if (next_address != -1)
+            next_address += chunk->next_address;
+    }
+
+    // every label has its place up front, so nothing has to grow while the threads insert
+    table->sym_cap = labels > table->sym_cap ? labels : table->sym_cap;
+    table->symbols = arena_alloc(arena, sizeof(Symbol) * table->sym_cap);
+    while (labels * 2 > table->slot_mask)
+        table->slot_mask = table->slot_mask * 2 + 1;
+    table->slots = arena_alloc(arena, sizeof(uint32_t) * (table->slot_mask + 1));
+    memset(table->slots, 0, sizeof(uint32_t) * (table->slot_mask + 1));
+    table->line_addrs = arena_alloc(arena, sizeof(int32_t) * token_list->len);
+    size_t *label_lines = arena_alloc(arena, sizeof(size_t) * labels);
+    SectionEnd *section_ends = arena_alloc(arena, sizeof(SectionEnd) * ends);
+    for (size_t i = 0, end = 0; i < thread_count; end += chunks[i++].ends) {
+        chunks[i].label_lines = label_lines;
+        chunks[i].section_ends = section_ends + end;
+    }
+    run_symbol_chunks(chunks, thread_count, assign_chunk);
+
+    // chunks are in line order, so the first one that failed has the first error. a label defined twice on or
+    // before that line comes before it, since labels are the first thing on their line
+    SymbolTableResult result = ST_SUCCESS;
+    size_t error_line = token_list->len;
+    for (size_t i = 0; i < thread_count && result == ST_SUCCESS; i++) {
+        if (chunks[i].result != ST_SUCCESS) {
+            result = chunks[i].result;
+            error_line = chunks[i].error_line;
+        }
+    }
+    // a chunk can be handed a duplicate from any chunk that lost a race to it, so only the lowest of them all is the
+    // first one in line order
+    uint32_t duplicate = 0;
+    for (size_t i = 0; i < thread_count; i++) {
+        if (chunks[i].duplicate && (!duplicate || chunks[i].duplicate < duplicate))
+            duplicate = chunks[i].duplicate;
+    }
+    if (duplicate && label_lines[duplicate - 1] <= error_line) {
+        result = ST_SYMBOL_ALREADY_EXISTS;
+        error_line = label_lines[duplicate - 1];
+    }
+    // sections only overlap earlier ones, which makes them the one part left in order
+    for (size_t i = 0; i < thread_count; i++) {
+        for (size_t j = 0; j < chunks[i].ends && chunks[i].section_ends[j].line < error_line; j++) {
+            const SectionEnd *end = &chunks[i].section_ends[j];
+            if (symbol_table_add_span(table, end->orig_addr, end->end_addr) != ST_SUCCESS) {
+                result = ST_OVERLAPPING_MEM;
+                error_line = end->line;
+                break;
+            }
+        }
+    }
+    if (result == ST_SUCCESS && next_address != -1)
+        result = ST_NO_END;
+
+    *lines_read = result == ST_SUCCESS || result == ST_NO_END ? token_list->len : error_line + 1;
+    // labels past the error can be in the slots, so a failed table is left empty rather than half filled
+    if (result == ST_SUCCESS)
+        table->sym_len = labels;
+    else
+        symbol_table_init(arena, table);
+    return result;
 }
 
 bool symbol_table_get(const SymbolTable *table, const char *span_start, size_t span_len, int32_t *output) {
+    uint32_t slot = *find_slot(table, span_start, span_len, hash_symbol(span_start, span_len));
+    if (slot == 0)
+        return false;
+    *output = table->symbols[slot - 1].addr;
+    return true;
+}
+
+bool write_symbol_file(const SymbolTable *table, const char *file_name) {
+    FILE *file = fopen(file_name, "w");
+    if (file == NULL)
+        return false;
+    fputs("// Symbol table\n"
+          "// Scope level 0:\n"
+          "//\tSymbol Name       Page Address\n"
+          "//\t----------------  ------------\n",
+          file);
     for (size_t i = 0; i < table->sym_len; i++) {
-        if (strncasecmp(table->symbols[i].symbol, span_start, span_len) == 0 &&
-            table->symbols[i].symbol[span_len] == 0) {  // prevents an error where a symbol ABC would be equal to ABCD
-                                                        // since ABC len is 3 and compares first 3 chars
-            *output = table->symbols[i].addr;
-            return true;
-        }
+        const Symbol *symbol = &table->symbols[i];
+        fprintf(file, "//\t%-16.*s  %04X\n", (int)symbol->span_len, symbol->span_start, symbol->addr);
     }
-    return false;
+    bool success = !ferror(file);
+    return fclose(file) == 0 && success;
 }
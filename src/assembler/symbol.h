@@ -3,19 +3,36 @@
 #include <stdbool.h>
 #include <stdint.h>
 
+#include "../arena.h"
 #include "token.h"
 
 typedef struct {
-    struct {
-        char *symbol;
-        int32_t addr;
-    } *symbols;
+    const char *span_start;
+    size_t span_len;
+    uint32_t hash;
+    int32_t addr;
+} Symbol;
+
+// has the lifetime of the text used to create it, and everything is allocated in arena
+typedef struct {
+    Arena *arena;
+    // in insertion order, so iterating symbols[0..sym_len) walks them in the order they were defined
+    Symbol *symbols;
     size_t sym_len;
+    size_t sym_cap;
+    // open addressing index into symbols, where 0 is an empty slot and n refers to symbols[n - 1]
+    uint32_t *slots;
+    size_t slot_mask;
+    // closed .orig/.end sections sorted by orig_addr, which never overlap each other
     struct {
         int32_t orig_addr;
         int32_t end_addr;
     } *addr_spans;
     size_t addr_len;
+    size_t addr_cap;
+    // the address each line starts at, or -1 outside a section, so later passes can start anywhere. only
+    // generate_symbol_table fills it in, otherwise it's null
+    int32_t *line_addrs;
 } SymbolTable;
 
 typedef enum {
@@ -29,14 +46,47 @@ typedef enum {
     ST_NO_BLKW_AMOUNT,
     ST_BAD_BLKW_AMOUNT,
     ST_BAD_STRINGZ,
-    ST_BAD_STRING_ESCAPE,
     ST_ORIG_INSIDE_ORIG,
     ST_NO_END,
     ST_SYMBOL_ALREADY_EXISTS,
 } SymbolTableResult;
 
-SymbolTableResult generate_symbol_table(SymbolTable *table, const LineTokensList *line_tokens, size_t *lines_read);
+typedef enum {
+    LINE_EMPTY,
+    LINE_ORIG,
+    LINE_END,
+    LINE_WORDS,
+} LineKind;
+
+// what a line does to the address, which can be worked out without knowing what came before it. the symbol pass and
+// the parser both move through sections with this, so they always agree on where every line is
+typedef struct {
+    int32_t words;    // the address of a .orig line, otherwise the words the line takes up
+    uint32_t labels;  // leading TEXT tokens, each one a label
+    uint8_t kind;
+    uint8_t result;  // what a .orig line gives outside a section, and what any other line gives inside one
+} LineSummary;
+
+// fills in summary and returns its result. on failure kind and labels are still set, but words may not be
+SymbolTableResult summarize_line(const LineTokens *line_tokens, LineSummary *summary);
+
+void symbol_table_init(Arena *arena, SymbolTable *table);
+
+SymbolTableResult symbol_table_add(SymbolTable *table, const char *span_start, size_t span_len, int32_t addr);
 
-void free_symbol_table(SymbolTable *table);
+// index of the first section starting after addr
+size_t addr_spans_upper_bound(const SymbolTable *table, int32_t addr);
+
+// inserts the section [orig_addr, end_addr] if it doesn't overlap any other section. empty sections always succeed
+SymbolTableResult symbol_table_add_span(SymbolTable *table, int32_t orig_addr, int32_t end_addr);
+
+SymbolTableResult generate_symbol_table(Arena *arena,
+                                        SymbolTable *table,
+                                        const LineTokensList *line_tokens,
+                                        size_t *lines_read);
 
 bool symbol_table_get(const SymbolTable *table, const char *span_start, size_t span_len, int32_t *output);
+
+// writes every symbol and its address in the .sym layout other LC-3 assemblers use, so the table can go alongside the
+// object file
+bool write_symbol_file(const SymbolTable *table, const char *file_name);
@@ -1,78 +1,178 @@
 #include <ctype.h>
-#include <errno.h>
 #include <limits.h>
+#include <pthread.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
-#include <strings.h>
+#include <string.h>
 
+#include "../utils.h"
 #include "token.h"
 
 typedef struct {
+    Arena *arena;
     const char *remaining;
+    const char *end;
     bool started_quote;
 } LineTokenizer;
 
-const struct {
-    char *string;
-    TokenType type;
-} TOKEN_STRS[] = {
-    {"ADD", ADD}, {"AND", AND},   {"JSR", JSR}, {"JSRR", JSRR}, {"LD", LD},   {"LDI", LDI},   {"LDR", LDR},
-    {"LEA", LEA}, {"NOT", NOT},   {"RTI", RTI}, {"ST", ST},     {"STI", STI}, {"STR", STR},   {"TRAP", TRAP},
-    {"RET", RET}, {"GETC", GETC}, {"OUT", OUT}, {"PUTS", PUTS}, {"IN", IN},   {"HALT", HALT},
-};
-
-const struct {
-    char *string;
-    TokenType type;
-} PSEUDOOP_STRS[] = {{"ORIG", ORIG}, {"FILL", FILL}, {"BLKW", BLKW}, {"STRINGZ", STRINGZ}, {"END", END}};
-
-const struct {
-    char *string;
-    BrFlags br_flags;
-} BR_STRS[] = {
-    {"BR", {.n = true, .z = true, .p = true}},
-    {"BRN", {.n = true}},
-    {"BRZ", {.z = true}},
-    {"BRP", {.p = true}},
-    {"BRNZ", {.n = true, .z = true}},
-    {"BRNP", {.n = true, .p = true}},
-    {"BRZP", {.z = true, .p = true}},
-    {"BRNZP", {.n = true, .z = true, .p = true}},
-};
+// keywords are packed into a u64 (first char in the low byte) with every byte folded by & 0xDF. since all keywords
+// are made of letters, a folded byte only lands in 'A'..'Z' if the source byte was a letter of either case, so the
+// comparison is exactly a case-insensitive match
+#define K1(a) ((uint64_t)(a))
+#define K2(a, b) (K1(a) | (uint64_t)(b) << 8)
+#define K3(a, b, c) (K2(a, b) | (uint64_t)(c) << 16)
+#define K4(a, b, c, d) (K3(a, b, c) | (uint64_t)(d) << 24)
+#define K5(a, b, c, d, e) (K4(a, b, c, d) | (uint64_t)(e) << 32)
+#define K6(a, b, c, d, e, f) (K5(a, b, c, d, e) | (uint64_t)(f) << 40)
+#define K7(a, b, c, d, e, f, g) (K6(a, b, c, d, e, f) | (uint64_t)(g) << 48)
+
+#define KEYWORD_MAX_LEN 7
+
+uint64_t fold_keyword(const char *text, size_t len) {
+    uint64_t key = 0;
+    for (size_t i = 0; i < len; i++)
+        key |= (uint64_t)(text[i] & 0xDF) << (i * 8);
+    return key;
+}
+
+#define MATCH(i_key, i_type) \
+    case i_key:              \
+        *type = i_type;      \
+        return true
+
+#define MATCH_BR(i_key, ...)                \
+    case i_key:                             \
+        *type = BR;                         \
+        *br_flags = (BrFlags){__VA_ARGS__}; \
+        return true
+
+// constant time lookup of instruction, trap alias, and branch mnemonics
+bool match_keyword(const char *text, size_t len, TokenType *type, BrFlags *br_flags) {
+    if (len > KEYWORD_MAX_LEN)
+        return false;
+    uint64_t key = fold_keyword(text, len);
+    switch (len) {
+        case 2:
+            switch (key) {
+                MATCH(K2('L', 'D'), LD);
+                MATCH(K2('S', 'T'), ST);
+                MATCH(K2('I', 'N'), IN);
+                MATCH_BR(K2('B', 'R'), .n = true, .z = true, .p = true);
+            }
+            break;
+        case 3:
+            switch (key) {
+                MATCH(K3('A', 'D', 'D'), ADD);
+                MATCH(K3('A', 'N', 'D'), AND);
+                MATCH(K3('J', 'M', 'P'), JMP);
+                MATCH(K3('J', 'S', 'R'), JSR);
+                MATCH(K3('L', 'D', 'I'), LDI);
+                MATCH(K3('L', 'D', 'R'), LDR);
+                MATCH(K3('L', 'E', 'A'), LEA);
+                MATCH(K3('N', 'O', 'T'), NOT);
+                MATCH(K3('R', 'T', 'I'), RTI);
+                MATCH(K3('S', 'T', 'I'), STI);
+                MATCH(K3('S', 'T', 'R'), STR);
+                MATCH(K3('R', 'E', 'T'), RET);
+                MATCH(K3('O', 'U', 'T'), OUT);
+                MATCH_BR(K3('B', 'R', 'N'), .n = true);
+                MATCH_BR(K3('B', 'R', 'Z'), .z = true);
+                MATCH_BR(K3('B', 'R', 'P'), .p = true);
+            }
+            break;
+        case 4:
+            switch (key) {
+                MATCH(K4('J', 'S', 'R', 'R'), JSRR);
+                MATCH(K4('T', 'R', 'A', 'P'), TRAP);
+                MATCH(K4('G', 'E', 'T', 'C'), GETC);
+                MATCH(K4('P', 'U', 'T', 'S'), PUTS);
+                MATCH(K4('H', 'A', 'L', 'T'), HALT);
+                MATCH_BR(K4('B', 'R', 'N', 'Z'), .n = true, .z = true);
+                MATCH_BR(K4('B', 'R', 'N', 'P'), .n = true, .p = true);
+                MATCH_BR(K4('B', 'R', 'Z', 'P'), .z = true, .p = true);
+            }
+            break;
+        case 5:
+            switch (key) {
+                MATCH(K5('P', 'U', 'T', 'S', 'P'), PUTSP);
+                MATCH_BR(K5('B', 'R', 'N', 'Z', 'P'), .n = true, .z = true, .p = true);
+            }
+            break;
+    }
+    return false;
+}
+
+// same as match_keyword but for the text after the leading '.'
+bool match_pseudoop(const char *text, size_t len, TokenType *type) {
+    if (len > KEYWORD_MAX_LEN)
+        return false;
+    switch (fold_keyword(text, len)) {
+        MATCH(K3('E', 'N', 'D'), END);
+        MATCH(K4('O', 'R', 'I', 'G'), ORIG);
+        MATCH(K4('F', 'I', 'L', 'L'), FILL);
+        MATCH(K4('B', 'L', 'K', 'W'), BLKW);
+        MATCH(K7('S', 'T', 'R', 'I', 'N', 'G', 'Z'), STRINGZ);
+    }
+    return false;
+}
+
+int hex_digit_value(char c) {
+    if (c >= '0' && c <= '9')
+        return c - '0';
+    if (toupper(c) >= 'A' && toupper(c) <= 'F')
+        return toupper(c) - 'A' + 10;
+    return -1;
+}
 
 LineTokenizerResult parse_int(const char *text, size_t cur_len, int32_t *output) {
-    errno = 0;
-    char *end;
-    long num = strtol(text + (toupper(text[0]) == 'X'), &end, (toupper(text[0]) == 'X') ? 16 : 10);
-    if ((num == LONG_MAX || num == LONG_MIN) && errno == ERANGE)
-        return LT_INTEGER_TOO_LARGE;
+    bool hex = toupper(text[0]) == 'X';
+    size_t i = hex;
+    bool negative = i < cur_len && text[i] == '-';
+    i += negative;
+    if (i == cur_len)
+        return LT_INVALID_INTEGER;
+
+    int32_t base = hex ? 16 : 10;
+    int32_t num = 0;
+    for (; i < cur_len; i++) {
+        int digit = hex_digit_value(text[i]);
+        if (digit < 0 || digit >= base)
+            return LT_INVALID_INTEGER;
+        num = num * base + digit;
+        if (num > USHRT_MAX - SHRT_MIN)  // stop before it can overflow, the range check below rejects it anyway
+            return LT_INTEGER_TOO_LARGE;
+    }
+    if (negative)
+        num = -num;
     if (num > USHRT_MAX || num < SHRT_MIN)
         return LT_INTEGER_TOO_LARGE;
-    if (text + cur_len != end)  // didn't fully use the number, so must be an invalid character somewhere inside it
-        return LT_INVALID_INTEGER;
 
     *output = num;
     return LT_SUCCESS;
 }
 
-bool is_number(const char *text) {
+bool is_number(const char *text, size_t len) {
     return ((text[0] >= '0' && text[0] <= '9') || text[0] == '-') ||
-           (toupper(text[0]) == 'X' &&
-            ((text[1] >= '0' && text[1] <= '9') || (toupper(text[1]) >= 'A' && toupper(text[1]) <= 'F')));
+           (toupper(text[0]) == 'X' && len > 1 && hex_digit_value(text[1]) >= 0);
+}
+
+// the character at offset i, or 0 past the end of the line
+char tokenizer_peek(const LineTokenizer *tokenizer, size_t i) {
+    return tokenizer->remaining + i < tokenizer->end ? tokenizer->remaining[i] : 0;
 }
 
 LineTokenizerResult line_tokenizer_next_token(LineTokenizer *tokenizer, Token *result) {
     // first, keep eating characters until either reaching a non-whitespace or comma
     bool found = false;
     while (!found) {
-        switch (tokenizer->remaining[0]) {
+        switch (tokenizer_peek(tokenizer, 0)) {
             case 0:
                 return LT_NO_MORE_TOKENS;
             case '\n':
                 return LT_NO_MORE_TOKENS;
             case ';':
-                tokenizer->remaining = "";
+                tokenizer->remaining = tokenizer->end;
                 return LT_NO_MORE_TOKENS;
             case ',':
                 *result = (Token){.span_start = tokenizer->remaining++, .span_len = 1, .type = COMMA};
@@ -82,6 +182,8 @@ LineTokenizerResult line_tokenizer_next_token(LineTokenizer *tokenizer, Token *r
                 tokenizer->started_quote = !tokenizer->started_quote;
                 return LT_SUCCESS;
             case ' ':
+            case '\t':
+            case '\r':
                 if (tokenizer->started_quote)
                     found = true;
                 else
@@ -94,43 +196,49 @@ LineTokenizerResult line_tokenizer_next_token(LineTokenizer *tokenizer, Token *r
     }
 
     // find where the current token ends
-    int cur_len = 0;
-    while ((tokenizer->started_quote || tokenizer->remaining[cur_len] != ' ') && tokenizer->remaining[cur_len] != 0 &&
-           tokenizer->remaining[cur_len] != ',' && tokenizer->remaining[cur_len] != '\n' &&
-           tokenizer->remaining[cur_len] != ';' && tokenizer->remaining[cur_len] != '"')
+    size_t cur_len = 0;
+    for (;;) {
+        char c = tokenizer_peek(tokenizer, cur_len);
+        if (c == 0 || c == ',' || c == '\n' || c == ';' || c == '"')
+            break;
+        if (!tokenizer->started_quote && (c == ' ' || c == '\t' || c == '\r'))
+            break;
         cur_len++;
+    }
 
-    for (size_t i = 0; i < sizeof(TOKEN_STRS) / sizeof(TOKEN_STRS[0]); i++) {
-        if (strncasecmp(tokenizer->remaining, TOKEN_STRS[i].string, cur_len) == 0 &&
-            TOKEN_STRS[i].string[cur_len] == 0) {
-            *result = (Token){.span_start = tokenizer->remaining, .span_len = cur_len, .type = TOKEN_STRS[i].type};
-            tokenizer->remaining += cur_len;
-            return LT_SUCCESS;
+    // anything between quotes is a string, even if it looks like a keyword or number
+    if (tokenizer->started_quote) {
+        *result = (Token){.span_start = tokenizer->remaining, .span_len = cur_len, .type = TEXT};
+        if (memchr(tokenizer->remaining, '\\', cur_len)) {
+            char *unescaped = arena_alloc(tokenizer->arena, cur_len);
+            if (unescape_string(tokenizer->remaining, cur_len, unescaped, &result->data.string.text_len) !=
+                US_SUCCESS)
+                return LT_BAD_STRING_ESCAPE;
+            result->data.string.text = unescaped;
+        } else {
+            result->data.string.text = tokenizer->remaining;
+            result->data.string.text_len = cur_len;
         }
+        tokenizer->remaining += cur_len;
+        return LT_SUCCESS;
     }
 
-    for (size_t i = 0; i < sizeof(BR_STRS) / sizeof(BR_STRS[0]); i++) {
-        if (strncasecmp(tokenizer->remaining, BR_STRS[i].string, cur_len) == 0 && BR_STRS[i].string[cur_len] == 0) {
-            BrFlags flags = BR_STRS[i].br_flags;
-            *result = (Token){
-                .span_start = tokenizer->remaining, .span_len = cur_len, .type = BR, .data = {.br_flags = flags}};
-            tokenizer->remaining += cur_len;
-            return LT_SUCCESS;
-        }
+    TokenType type;
+    BrFlags br_flags = {0};
+    if (match_keyword(tokenizer->remaining, cur_len, &type, &br_flags)) {
+        *result = (Token){
+            .span_start = tokenizer->remaining, .span_len = cur_len, .type = type, .data = {.br_flags = br_flags}};
+        tokenizer->remaining += cur_len;
+        return LT_SUCCESS;
     }
 
     // if text starts with ., it must be a pseudoop
     if (tokenizer->remaining[0] == '.') {
-        for (size_t i = 0; i < sizeof(PSEUDOOP_STRS) / sizeof(PSEUDOOP_STRS[0]); i++) {
-            if (strncasecmp(tokenizer->remaining + 1, PSEUDOOP_STRS[i].string, cur_len - 1) == 0 &&
-                PSEUDOOP_STRS[i].string[cur_len - 1] == 0) {
-                *result =
-                    (Token){.span_start = tokenizer->remaining, .span_len = cur_len, .type = PSEUDOOP_STRS[i].type};
-                tokenizer->remaining += cur_len;
-                return LT_SUCCESS;
-            }
-        }
-        return LT_BAD_PSEUDOOP;
+        if (!match_pseudoop(tokenizer->remaining + 1, cur_len - 1, &type))
+            return LT_BAD_PSEUDOOP;
+        *result = (Token){.span_start = tokenizer->remaining, .span_len = cur_len, .type = type};
+        tokenizer->remaining += cur_len;
+        return LT_SUCCESS;
     }
 
     // if text starts with an R and is of length
@@ -148,7 +256,7 @@ LineTokenizerResult line_tokenizer_next_token(LineTokenizer *tokenizer, Token *r
     }
 
     // if text starts with a number, minus sign, or x, attempt to parse it and return an error if it fails
-    if (is_number(tokenizer->remaining)) {
+    if (is_number(tokenizer->remaining, cur_len)) {
         int32_t num;
         LineTokenizerResult err;
         if ((err = parse_int(tokenizer->remaining, cur_len, &num)) != LT_SUCCESS)
@@ -170,34 +278,115 @@ LineTokenizerResult line_tokenizer_next_token(LineTokenizer *tokenizer, Token *r
     return LT_SUCCESS;
 }
 
-LineTokenizerResult tokenize_lines(LineTokensList *list, const char **lines, size_t line_count, size_t *lines_read) {
-    *lines_read = 0;
-    list->len = 0;
-    size_t list_cap = 50;
-    list->line_tokens = malloc(sizeof(LineTokens) * list_cap);
-    for (size_t i = 0; i < line_count; i++) {
-        (*lines_read)++;
-        size_t line_tokens_cap = 5;
-        LineTokens line_tokens = {.tokens = malloc(sizeof(Token) * line_tokens_cap), .line = *lines_read, .len = 0};
-        LineTokenizer tokenizer = {.remaining = lines[i]};
-        LineTokenizerResult result;
+// lines per thread below which starting the thread costs more than it saves
+#define TOKENIZE_CHUNK_LINES 16384
+
+// a run of lines tokenized by one thread, into an arena of its own
+typedef struct {
+    pthread_t thread;
+    bool threaded;  // false if the thread couldn't be created and the chunk ran on the caller's
+    Arena arena;
+    const SourceLine *lines;
+    LineTokens *line_tokens;  // the chunk's slice of LineTokensList.line_tokens
+    size_t first;
+    size_t count;
+    size_t token_len;
+    size_t lines_read;
+    LineTokenizerResult result;
+} TokenizeChunk;
+
+// tokenizes count lines, the first of them line number first + 1, into one token array. on failure lines_read is the
+// line that failed, and the lines before it are still filled in
+LineTokenizerResult tokenize_range(Arena *arena,
+                                   LineTokens *line_tokens,
+                                   const SourceLine *lines,
+                                   size_t first,
+                                   size_t count,
+                                   size_t *token_len,
+                                   size_t *lines_read) {
+    size_t tokens_cap = count * 4 + 16, len = 0;
+    Token *tokens = arena_alloc(arena, sizeof(Token) * tokens_cap);
+    LineTokenizerResult result = LT_NO_MORE_TOKENS;
+    size_t done = 0;
+    for (; done < count; done++) {
+        *lines_read = first + done + 1;
+        LineTokens line = {.line = *lines_read, .len = 0};
+        LineTokenizer tokenizer = {
+            .arena = arena, .remaining = lines[done].start, .end = lines[done].start + lines[done].len};
         Token token;
         while ((result = line_tokenizer_next_token(&tokenizer, &token)) == LT_SUCCESS) {
-            if (line_tokens.len == line_tokens_cap)
-                line_tokens.tokens = realloc(line_tokens.tokens, sizeof(Token) * (line_tokens_cap *= 2));
-            line_tokens.tokens[line_tokens.len++] = token;
-        }
-        // propagate the failure up
-        if (result != LT_NO_MORE_TOKENS) {
-            free(line_tokens.tokens);
-            return result;
+            if (len == tokens_cap) {
+                tokens = arena_grow(arena, tokens, sizeof(Token) * tokens_cap, sizeof(Token) * tokens_cap * 2);
+                tokens_cap *= 2;
+            }
+            tokens[len++] = token;
+            line.len++;
         }
+        // propagate the failure up, once the lines before it are pointed at their tokens
+        if (result != LT_NO_MORE_TOKENS)
+            break;
 
-        if (list->len == list_cap)
-            list->line_tokens = realloc(list->line_tokens, sizeof(LineTokens) * (list_cap *= 2));
-        list->line_tokens[list->len++] = line_tokens;
+        line_tokens[done] = line;
     }
-    return LT_SUCCESS;
+
+    // the token array is done moving, so each line can point at its slice of it
+    *token_len = 0;
+    for (size_t i = 0; i < done; i++) {
+        line_tokens[i].tokens = tokens + *token_len;
+        *token_len += line_tokens[i].len;
+    }
+    return result == LT_NO_MORE_TOKENS ? LT_SUCCESS : result;
+}
+
+void *tokenize_worker(void *arg) {
+    TokenizeChunk *chunk = arg;
+    chunk->result = tokenize_range(&chunk->arena, chunk->line_tokens, chunk->lines, chunk->first, chunk->count,
+                                   &chunk->token_len, &chunk->lines_read);
+    return NULL;
+}
+
+LineTokenizerResult tokenize_lines(Arena *arena,
+                                   LineTokensList *list,
+                                   const SourceLine *lines,
+                                   size_t line_count,
+                                   size_t *lines_read) {
+    *lines_read = 0;
+    list->token_len = 0;
+    list->line_tokens = arena_alloc(arena, sizeof(LineTokens) * line_count);
+    LineTokenizerResult result = LT_SUCCESS;
+    size_t thread_count = parallel_threads(line_count, TOKENIZE_CHUNK_LINES);
+    if (thread_count == 1)
+        result = tokenize_range(arena, list->line_tokens, lines, 0, line_count, &list->token_len, lines_read);
+    else {
+        // every line is tokenized on its own, so the chunks only meet again in line_tokens
+        TokenizeChunk *chunks = arena_alloc(arena, sizeof(TokenizeChunk) * thread_count);
+        for (size_t i = 0; i < thread_count; i++) {
+            size_t first = i * line_count / thread_count, end = (i + 1) * line_count / thread_count;
+            chunks[i] = (TokenizeChunk){
+                .lines = lines + first, .line_tokens = list->line_tokens + first, .first = first, .count = end - first};
+            arena_init(&chunks[i].arena);
+            chunks[i].threaded = pthread_create(&chunks[i].thread, NULL, tokenize_worker, &chunks[i]) == 0;
+            if (!chunks[i].threaded)
+                tokenize_worker(&chunks[i]);
+        }
+        for (size_t i = 0; i < thread_count; i++) {
+            if (chunks[i].threaded)
+                pthread_join(chunks[i].thread, NULL);
+            arena_adopt(arena, &chunks[i].arena);
+            if (result == LT_SUCCESS)
+                list->token_len += chunks[i].token_len;
+            // chunks are in line order, so the first one that failed has the first line that did. the lines before
+            // it are all filled in, the ones after aren't part of the list
+            if (result == LT_SUCCESS && chunks[i].result != LT_SUCCESS) {
+                result = chunks[i].result;
+                *lines_read = chunks[i].lines_read;
+            }
+        }
+        if (result == LT_SUCCESS)
+            *lines_read = line_count;
+    }
+    list->len = result == LT_SUCCESS ? line_count : *lines_read - 1;
+    return result;
 }
 
 char *token_type_string(TokenType token_type) {
@@ -264,6 +453,8 @@ char *token_type_string(TokenType token_type) {
             return "GETC";
         case IN:
             return "IN";
+        case PUTSP:
+            return "PUTSP";
         case OUT:
             return "OUT";
     }
@@ -299,9 +490,3 @@ void debug_token_print(const Token *token) {
 
     printf(" span: %.*s\n", (int)token->span_len, token->span_start);
 }
-
-void free_tokens_list(LineTokensList *list) {
-    for (size_t i = 0; i < list->len; i++)
-        free(list->line_tokens[i].tokens);
-    free(list->line_tokens);
-}
@@ -4,6 +4,8 @@
 #include <stddef.h>
 #include <stdint.h>
 
+#include "../arena.h"
+
 typedef enum {
     ADD,
     AND,
@@ -33,6 +35,7 @@ typedef enum {
     OUT,
     PUTS,
     IN,
+    PUTSP,
     HALT,
     RET,
     NUMBER,
@@ -47,22 +50,28 @@ typedef struct {
 
 typedef struct {
     const char *span_start;
-    size_t span_len;
+    uint32_t span_len;
+    TokenType type;
     union {
         BrFlags br_flags;
         uint8_t reg;
         int32_t number;
+        // text between quotes with its escapes already decoded. it's the span itself when there's nothing to decode
+        struct {
+            const char *text;
+            size_t text_len;
+        } string;
     } data;
-    TokenType type;
 } Token;
 
 typedef struct {
-    Token *tokens;
+    Token *tokens;  // back to back with the tokens of the other lines the same thread tokenized
     size_t line;
     size_t len;
 } LineTokens;
 
 typedef struct {
+    size_t token_len;  // of every line together
     LineTokens *line_tokens;
     size_t len;
 } LineTokensList;
@@ -73,10 +82,22 @@ typedef enum {
     LT_INTEGER_TOO_LARGE,
     LT_INVALID_INTEGER,
     LT_BAD_PSEUDOOP,
+    LT_BAD_STRING_ESCAPE,
 } LineTokenizerResult;
 
-LineTokenizerResult tokenize_lines(LineTokensList *list, const char **lines, size_t line_count, size_t *lines_read);
+// a view of one line of source text, which doesn't need to be null terminated
+typedef struct {
+    const char *start;
+    size_t len;
+} SourceLine;
 
-void free_tokens_list(LineTokensList *list);
+// everything, including decoded strings, is allocated in the arena, and tokens point into the source lines. large
+// sources are split into runs of lines tokenized on threads of their own. on failure lines_read is the first line
+// that failed, no matter which thread got to its error first
+LineTokenizerResult tokenize_lines(Arena *arena,
+                                   LineTokensList *list,
+                                   const SourceLine *lines,
+                                   size_t line_count,
+                                   size_t *lines_read);
 
 void debug_token_print(const Token *token);
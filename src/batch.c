@@ -0,0 +1,384 @@
+#include <ctype.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "arena.h"
+#include "assembler/assembler.h"
+#include "assembler/source.h"
+#include "batch.h"
+#include "console.h"
+#include "jit.h"
+#include "lanes.h"
+#include "vm.h"
+
+// jobs a worker still has to run. the owner takes from the back and other workers steal from the front
+typedef struct {
+    pthread_mutex_t lock;
+    size_t *jobs;
+    size_t head;
+    size_t tail;
+} JobQueue;
+
+typedef struct {
+    const BatchJob *jobs;
+    const BatchOptions *options;
+    JobQueue *queues;
+    size_t queue_count;
+    FILE *out;
+} BatchShared;
+
+typedef struct {
+    BatchShared *shared;
+    size_t id;
+    pthread_t thread;
+    bool failed;  // its VM couldn't be mapped, so it left every job to the other workers
+    VirtualMachine vm;
+    // the last program this worker loaded, right after loading it. the next job with the same program restores
+    // this instead of assembling and loading again
+    VmSnapshot snapshot;
+    const char *loaded;
+    // the other VMs a group of jobs runs on in lockstep, along with vm
+    VirtualMachine lanes[LANES_MAX - 1];
+} BatchWorker;
+
+// pops the job at the back and up to cap - 1 more behind it with the same program, so they can run together
+size_t job_queue_pop_group(JobQueue *queue, const BatchJob *jobs, size_t *group, size_t cap) {
+    pthread_mutex_lock(&queue->lock);
+    size_t len = 0;
+    while (len < cap && queue->head < queue->tail &&
+           (len == 0 || strcmp(jobs[queue->jobs[queue->tail - 1]].program, jobs[group[0]].program) == 0))
+        group[len++] = queue->jobs[--queue->tail];
+    pthread_mutex_unlock(&queue->lock);
+    return len;
+}
+
+bool job_queue_steal(JobQueue *queue, size_t *job) {
+    pthread_mutex_lock(&queue->lock);
+    bool found = queue->head < queue->tail;
+    if (found)
+        *job = queue->jobs[queue->head++];
+    pthread_mutex_unlock(&queue->lock);
+    return found;
+}
+
+void write_json_string(FILE *out, const char *text, size_t len) {
+    fputc('"', out);
+    for (size_t i = 0; i < len; i++) {
+        unsigned char c = text[i];
+        if (c == '"' || c == '\\')
+            fprintf(out, "\\%c", c);
+        else if (c == '\n')
+            fputs("\\n", out);
+        else if (c < 0x20 || c >= 0x7F)
+            fprintf(out, "\\u%04x", c);
+        else
+            fputc(c, out);
+    }
+    fputc('"', out);
+}
+
+const char *stop_reason_name(VmStopReason reason) {
+    switch (reason) {
+        case VM_STOP_HALT:
+            return "halt";
+        case VM_STOP_STEP_LIMIT:
+            return "step_limit";
+        case VM_STOP_UNIMPLEMENTED:
+            return "unimplemented";
+        case VM_STOP_JIT_MISMATCH:
+            return "jit_mismatch";
+        case VM_STOP_INPUT_ENDED:
+            return "input_ended";
+    }
+    return "unknown";
+}
+
+// loads the job's program into vm, or returns why it couldn't
+const char *batch_load(VirtualMachine *vm, const BatchJob *job, Arena *arena, size_t *error_line) {
+    size_t len = strlen(job->program);
+    if (len < 4 || strcmp(job->program + len - 4, ".asm") != 0)
+        return vm_load(vm, job->program) ? NULL : "load failed";
+
+    SourceFile source;
+    if (source_file_open(&source, job->program) != SF_SUCCESS)
+        return "open failed";
+    ObjectImage image;
+    const char *error = NULL;
+    switch (assemble(arena, &source, &image, error_line)) {
+        case AS_SUCCESS:
+            if (!vm_load_image(vm, &image))
+                error = "load failed";
+            break;
+        case AS_TOKENIZE_FAILED:
+            error = "tokenize failed";
+            break;
+        case AS_SYMBOL_FAILED:
+            error = "symbol table failed";
+            break;
+        case AS_PARSE_FAILED:
+            error = "parse failed";
+            break;
+    }
+    source_file_close(&source);
+    return error;
+}
+
+// puts the job's program into the worker's VM from scratch, and keeps a snapshot of it for the jobs after
+const char *batch_reload(BatchWorker *worker, const BatchJob *job, Arena *arena, size_t *error_line) {
+    if (worker->loaded) {
+        vm_snapshot_free(&worker->snapshot);
+        worker->loaded = NULL;
+    }
+    // the lanes only have pages the last program dirtied marked, the next snapshot has to be copied over them whole
+    for (size_t i = 0; i < LANES_MAX - 1; i++)
+        worker->lanes[i].dirty_base = NULL;
+    vm_randomize(&worker->vm, worker->shared->options->seed);
+    const char *error = batch_load(&worker->vm, job, arena, error_line);
+    if (!error && vm_snapshot(&worker->vm, &worker->snapshot))
+        worker->loaded = job->program;
+    return error;
+}
+
+// one job of a group, from opening its input to writing its result
+typedef struct {
+    size_t index;
+    Console console;
+    int input;
+    size_t error_line;
+    const char *error;
+    VmStopReason reason;
+} BatchRun;
+
+void batch_report(const BatchShared *shared, const BatchRun *run, const VirtualMachine *vm) {
+    const BatchJob *job = &shared->jobs[run->index];
+    // one locked write per job so lines from different workers don't interleave
+    FILE *out = shared->out;
+    flockfile(out);
+    fprintf(out, "{\"job\":%lu,\"program\":", run->index);
+    write_json_string(out, job->program, strlen(job->program));
+    fputs(",\"input\":", out);
+    write_json_string(out, job->input, strlen(job->input));
+    if (run->error) {
+        fputs(",\"error\":", out);
+        write_json_string(out, run->error, strlen(run->error));
+        if (run->error_line)
+            fprintf(out, ",\"line\":%lu", run->error_line);
+    } else {
+        fprintf(out, ",\"reason\":\"%s\",\"steps\":%lu,\"output\":", stop_reason_name(run->reason), vm->steps);
+        write_json_string(out, run->console.captured, run->console.captured_len);
+    }
+    fputs("}\n", out);
+    fflush(out);
+    funlockfile(out);
+}
+
+// runs jobs that all have the same program, on the worker's VM alone or on its lanes in lockstep
+void batch_run_group(BatchWorker *worker, const size_t *indices, size_t count) {
+    const BatchShared *shared = worker->shared;
+    Arena arena;
+    arena_init(&arena);
+    BatchRun runs[LANES_MAX];
+    VirtualMachine *vms[LANES_MAX];
+    uint64_t max_steps[LANES_MAX];
+    VmStopReason reasons[LANES_MAX];
+    size_t error_line = 0, len = 0;
+    const char *load_error = NULL;
+
+    for (size_t i = 0; i < count; i++) {
+        BatchRun *run = &runs[i];
+        const BatchJob *job = &shared->jobs[indices[i]];
+        *run = (BatchRun){.index = indices[i], .input = -1};
+        console_init(&run->console);
+        console_output_memory(&run->console);
+        if (strcmp(job->input, "-") != 0 && (run->input = open(job->input, O_RDONLY)) < 0) {
+            run->error = "input open failed";
+            continue;
+        }
+        // the program is only loaded once a job needs it, and isn't tried again for the rest if it failed
+        if (!load_error && (!worker->loaded || strcmp(worker->loaded, job->program) != 0))
+            load_error = batch_reload(worker, job, &arena, &error_line);
+        if (load_error) {
+            run->error = load_error;
+            run->error_line = error_line;
+            continue;
+        }
+        if (run->input >= 0)
+            console_input_fd(&run->console, run->input);
+        // jobs that can run go on the next free lane, the first of them on the worker's own VM
+        VirtualMachine *vm = len == 0 ? &worker->vm : &worker->lanes[len - 1];
+        vm_restore(vm, &worker->snapshot);
+        vm->console = &run->console;
+        vms[len] = vm;
+        max_steps[len++] = job->max_steps;
+    }
+
+    if (len > 1)
+        lanes_run(vms, max_steps, reasons, len);
+    else if (len == 1)
+        reasons[0] = vms[0]->jit ? vm_run_jit(vms[0], max_steps[0]) : vm_run(vms[0], max_steps[0]);
+
+    for (size_t i = 0, lane = 0; i < count; i++) {
+        BatchRun *run = &runs[i];
+        const VirtualMachine *vm = NULL;
+        if (!run->error) {
+            vm = vms[lane];
+            run->reason = reasons[lane++];
+            console_flush(&run->console);
+            vms[lane - 1]->console = NULL;
+        }
+        batch_report(shared, run, vm);
+        console_free(&run->console);
+        if (run->input >= 0)
+            close(run->input);
+    }
+    arena_free(&arena);
+}
+
+void *batch_worker(void *arg) {
+    BatchWorker *worker = arg;
+    BatchShared *shared = worker->shared;
+    // one VM per worker, reused for every job it runs, and one per extra lane in lockstep mode
+    VirtualMachine *vm = &worker->vm;
+    if (!vm_init(vm)) {
+        worker->failed = true;
+        return NULL;
+    }
+    size_t lane_count = 1;
+    if (shared->options->lanes) {
+        while (lane_count < LANES_MAX && vm_init(&worker->lanes[lane_count - 1]))
+            lane_count++;
+    } else if (shared->options->jit)
+        jit_attach(vm, false);
+    worker->loaded = NULL;
+
+    for (;;) {
+        size_t group[LANES_MAX];
+        size_t len = job_queue_pop_group(&shared->queues[worker->id], shared->jobs, group, lane_count);
+        for (size_t i = 1; len == 0 && i < shared->queue_count; i++)
+            len = job_queue_steal(&shared->queues[(worker->id + i) % shared->queue_count], group);
+        // nothing gets queued once the workers start, so empty everywhere means done
+        if (len == 0)
+            break;
+        batch_run_group(worker, group, len);
+    }
+
+    if (worker->loaded)
+        vm_snapshot_free(&worker->snapshot);
+    for (size_t i = 0; i + 1 < lane_count; i++)
+        vm_free(&worker->lanes[i]);
+    vm_free(vm);
+    return NULL;
+}
+
+// splits the manifest into jobs, with the strings copied into arena
+bool parse_manifest(Arena *arena, const SourceFile *source, BatchJob **jobs, size_t *job_len, size_t *bad_line) {
+    *jobs = arena_alloc(arena, sizeof(BatchJob) * (source->line_count + 1));
+    *job_len = 0;
+    for (size_t line = 0; line < source->line_count; line++) {
+        const char *text = source->lines[line].start, *end = text + source->lines[line].len;
+        const char *fields[3];
+        size_t field_lens[3], field_count = 0;
+        for (;;) {
+            while (text < end && isspace((unsigned char)*text))
+                text++;
+            if (text == end || *text == '#')
+                break;
+            const char *start = text;
+            while (text < end && !isspace((unsigned char)*text))
+                text++;
+            if (field_count == 3) {
+                *bad_line = line + 1;
+                return false;
+            }
+            fields[field_count] = start;
+            field_lens[field_count++] = text - start;
+        }
+        // blank lines and comments
+        if (field_count == 0)
+            continue;
+        if (field_count != 3) {
+            *bad_line = line + 1;
+            return false;
+        }
+
+        BatchJob *job = &(*jobs)[(*job_len)++];
+        char *strings[3];
+        for (size_t i = 0; i < 3; i++) {
+            strings[i] = arena_alloc(arena, field_lens[i] + 1);
+            memcpy(strings[i], fields[i], field_lens[i]);
+            strings[i][field_lens[i]] = '\0';
+        }
+        job->program = strings[0];
+        job->input = strings[1];
+        char *steps_end;
+        job->max_steps = strtoull(strings[2], &steps_end, 10);
+        if (*steps_end != '\0' || !isdigit((unsigned char)strings[2][0])) {
+            *bad_line = line + 1;
+            return false;
+        }
+    }
+    return true;
+}
+
+BatchResult batch_run(const char *manifest, const BatchOptions *options, FILE *out, size_t *bad_line) {
+    SourceFile source;
+    if (source_file_open(&source, manifest) != SF_SUCCESS)
+        return BA_MANIFEST_OPEN_FAILED;
+    Arena arena;
+    arena_init(&arena);
+    BatchResult result = BA_SUCCESS;
+    BatchJob *jobs;
+    size_t job_len;
+    if (!parse_manifest(&arena, &source, &jobs, &job_len, bad_line)) {
+        result = BA_BAD_MANIFEST_LINE;
+        goto free_manifest;
+    }
+
+    // deal the jobs out in consecutive runs so every worker starts with a share, stealing evens out the rest.
+    // manifests usually list every input for a program together, and a worker only loads a program once per run
+    size_t thread_count = options->thread_count ? options->thread_count : 1;
+    BatchShared shared = {jobs, options, arena_alloc(&arena, sizeof(JobQueue) * thread_count), thread_count, out};
+    for (size_t i = 0; i < thread_count; i++) {
+        JobQueue *queue = &shared.queues[i];
+        pthread_mutex_init(&queue->lock, NULL);
+        queue->jobs = arena_alloc(&arena, sizeof(size_t) * (job_len / thread_count + 1));
+        queue->head = queue->tail = 0;
+        for (size_t job = i * job_len / thread_count; job < (i + 1) * job_len / thread_count; job++)
+            queue->jobs[queue->tail++] = job;
+    }
+
+    BatchWorker *workers = arena_alloc(&arena, sizeof(BatchWorker) * thread_count);
+    for (size_t i = 0; i < thread_count; i++)
+        workers[i] = (BatchWorker){.shared = &shared, .id = i};
+    size_t started = 0;
+    for (; started < thread_count; started++) {
+        if (pthread_create(&workers[started].thread, NULL, batch_worker, &workers[started]) != 0)
+            break;
+    }
+    // out of threads, this one runs the next worker itself. it steals from the queues nobody else started on
+    size_t ran = started;
+    if (started < thread_count)
+        batch_worker(&workers[ran++]);
+    for (size_t i = 0; i < started; i++)
+        pthread_join(workers[i].thread, NULL);
+    // the jobs of a worker that failed are stolen by the others, so they only go unrun if every worker failed
+    result = BA_VM_INIT_FAILED;
+    for (size_t i = 0; i < ran; i++) {
+        if (!workers[i].failed)
+            result = BA_SUCCESS;
+    }
+    for (size_t i = 0; i < thread_count; i++)
+        pthread_mutex_destroy(&shared.queues[i].lock);
+
+free_manifest:
+    arena_free(&arena);
+    source_file_close(&source);
+    return result;
+}
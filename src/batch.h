@@ -0,0 +1,33 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+// one line of the manifest: a program, the file its input comes from ("-" for none) and its step budget. programs
+// ending in .asm are assembled first, anything else is loaded as an object file
+typedef struct {
+    char *program;
+    char *input;
+    uint64_t max_steps;
+} BatchJob;
+
+typedef struct {
+    size_t thread_count;
+    uint64_t seed;  // every job's VM starts from the same garbage, so runs are reproducible
+    bool jit;
+    // runs jobs with the same program in lockstep, LANES_MAX at a time, instead of the jit
+    bool lanes;
+} BatchOptions;
+
+typedef enum {
+    BA_SUCCESS,
+    BA_MANIFEST_OPEN_FAILED,
+    BA_BAD_MANIFEST_LINE,
+    BA_VM_INIT_FAILED,  // no worker could map a VM, so no job ran
+} BatchResult;
+
+// runs every job in the manifest across a pool of threads, writing one JSON object per job to out as each one
+// finishes. on BA_BAD_MANIFEST_LINE bad_line is the line that couldn't be read, and nothing has run
+BatchResult batch_run(const char *manifest, const BatchOptions *options, FILE *out, size_t *bad_line);
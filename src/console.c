@@ -0,0 +1,137 @@
+#include <errno.h>
+#include <poll.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "console.h"
+
+void console_init(Console *console) {
+    memset(console, 0, sizeof(*console));
+    console->input_fd = -1;
+}
+
+void console_free(Console *console) {
+    free(console->captured);
+    console->captured = NULL;
+}
+
+size_t console_read_fd(Console *console, char *buf, size_t len) {
+    for (;;) {
+        ssize_t n = read(console->input_fd, buf, len);
+        if (n >= 0)
+            return n;
+        // errors read as end of input, same as fgetc
+        if (errno != EINTR)
+            return 0;
+    }
+}
+
+bool console_ready_fd(Console *console) {
+    struct pollfd pollfd = {.fd = console->input_fd, .events = POLLIN};
+    // an error or hangup is ready too, read returns straight away with the end of input
+    return poll(&pollfd, 1, 0) != 0;
+}
+
+void console_input_fd(Console *console, int fd) {
+    console->read = console_read_fd;
+    console->ready = console_ready_fd;
+    console->input_fd = fd;
+    console->in_pos = console->in_len = 0;
+    console->in_ended = false;
+}
+
+void console_input_memory(Console *console, const char *data, size_t len) {
+    // all of it is already buffered, so there's nothing to read once it runs out
+    console->read = NULL;
+    console->ready = NULL;
+    console->in = data;
+    console->in_pos = 0;
+    console->in_len = len;
+}
+
+void console_write_file(Console *console, const char *buf, size_t len) {
+    FILE *file = console->context;
+    fwrite(buf, 1, len, file);
+    fflush(file);
+}
+
+void console_output_file(Console *console, FILE *file) {
+    console->write = console_write_file;
+    console->context = file;
+}
+
+void console_write_memory(Console *console, const char *buf, size_t len) {
+    if (console->captured_len + len > console->captured_cap) {
+        size_t cap = console->captured_cap ? console->captured_cap : CONSOLE_BUFFER_SIZE;
+        while (cap < console->captured_len + len)
+            cap *= 2;
+        char *captured = realloc(console->captured, cap);
+        if (!captured)
+            return;
+        console->captured = captured;
+        console->captured_cap = cap;
+    }
+    memcpy(console->captured + console->captured_len, buf, len);
+    console->captured_len += len;
+}
+
+void console_output_memory(Console *console) {
+    console->write = console_write_memory;
+}
+
+// reads the next buffer of input, blocking if there isn't any yet. returns false at the end of input
+bool console_fill(Console *console) {
+    if (!console->read || console->in_ended)
+        return false;
+    // whatever the guest printed last is usually the prompt for this input
+    console_flush(console);
+    size_t n = console->read(console, console->in_buf, sizeof(console->in_buf));
+    if (n == 0) {
+        console->in_ended = true;
+        return false;
+    }
+    console->in = console->in_buf;
+    console->in_pos = 0;
+    console->in_len = n;
+    return true;
+}
+
+int console_getc(Console *console) {
+    if (!console || (console->in_pos == console->in_len && !console_fill(console)))
+        return EOF;
+    return (unsigned char)console->in[console->in_pos++];
+}
+
+bool console_input_ready(Console *console) {
+    if (!console)
+        return false;
+    if (console->in_pos < console->in_len)
+        return true;
+    if (!console->read || console->in_ended || (console->ready && !console->ready(console)))
+        return false;
+    return console_fill(console);
+}
+
+bool console_wait(Console *console) {
+    return console && (console->in_pos < console->in_len || console_fill(console));
+}
+
+void console_putc(Console *console, char c) {
+    if (!console)
+        return;
+    if (console->out_len == sizeof(console->out_buf))
+        console_flush(console);
+    console->out_buf[console->out_len++] = c;
+}
+
+void console_flush(Console *console) {
+    if (!console || console->out_len == 0)
+        return;
+    if (console->write)
+        console->write(console, console->out_buf, console->out_len);
+    console->out_len = 0;
+}
@@ -0,0 +1,68 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdio.h>
+
+#define CONSOLE_BUFFER_SIZE 4096
+
+typedef struct Console Console;
+
+// the device the trap routines talk to. output is collected in out_buf and handed to write in one go when the
+// buffer fills, when the guest halts, before the console blocks on input, and on console_flush. input is read a
+// buffer at a time. set read, write and ready directly to plug in another device
+struct Console {
+    // fills buf with up to len bytes and returns how many, 0 at the end of input. null reads as end of input
+    size_t (*read)(Console *console, char *buf, size_t len);
+    // has to take all len bytes. null drops the output
+    void (*write)(Console *console, const char *buf, size_t len);
+    // returns whether read would return without blocking. null means it never blocks
+    bool (*ready)(Console *console);
+    void *context;  // whatever read and write need, a FILE for console_output_file
+    int input_fd;
+    // input the guest hasn't taken yet. in_buf, or the caller's memory for console_input_memory
+    const char *in;
+    size_t in_pos;
+    size_t in_len;
+    bool in_ended;  // read returned 0, nothing more is coming
+    size_t out_len;
+    // everything written so far with console_output_memory, owned by the console
+    char *captured;
+    size_t captured_len;
+    size_t captured_cap;
+    char in_buf[CONSOLE_BUFFER_SIZE];
+    char out_buf[CONSOLE_BUFFER_SIZE];
+};
+
+// starts with no input and output dropped
+void console_init(Console *console);
+
+void console_free(Console *console);
+
+// reads from a file or pipe, taking whatever each read returns so interactive input isn't held back
+void console_input_fd(Console *console, int fd);
+
+// reads data, which has to outlive the console's use of it, without copying it
+void console_input_memory(Console *console, const char *data, size_t len);
+
+// writes to file and flushes it every time the console flushes, so output stays in order with anything else
+// printed to the same file
+void console_output_file(Console *console, FILE *file);
+
+// collects everything written into captured
+void console_output_memory(Console *console);
+
+// the console functions all take a null console, which reads as end of input and drops output
+
+// returns EOF at the end of input
+int console_getc(Console *console);
+
+// returns whether console_getc has a character it can return without blocking
+bool console_input_ready(Console *console);
+
+// blocks until console_getc has a character to return, returning false if input ended first
+bool console_wait(Console *console);
+
+void console_putc(Console *console, char c);
+
+void console_flush(Console *console);
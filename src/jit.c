@@ -0,0 +1,642 @@
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+
+#include "jit.h"
+#include "vm.h"
+
+#if JIT_AVAILABLE
+
+// register use inside generated code:
+//   r8-r15 - guest r0-r7, zero extended. they're only ever written with 16 bit operations or zero extending moves so
+//            the top half stays clear and they can index memory directly
+//   rbx    - guest memory
+//   rbp    - the cc value, see Jit.value
+//   rsi    - steps left
+//   rdi    - the Jit
+//   rax, rcx, rdx - scratch
+enum { RAX, RCX, RDX, RBX, RSP, RBP, RSI, RDI, R8, R9, R10, R11, R12, R13, R14, R15 };
+#define GUEST(i_reg) (R8 + (i_reg))
+// as the index of a memory operand, no index
+#define NO_INDEX RSP
+
+// the block cache is flushed when less than this is left, which covers the largest possible block
+#define JIT_BLOCK_SPACE (JIT_MAX_BLOCK_LEN * 192 + 256)
+
+typedef struct {
+    uint8_t *code;
+    size_t len;
+} JitEmitter;
+
+typedef enum {
+    STUB_CHAIN,     // direct jump to a block start, pc is the target
+    STUB_INDIRECT,  // indirect jump that missed, the target is in eax
+    STUB_STORE,     // store into translated code, pc is the next instruction
+    STUB_INTERP,    // pc has to be interpreted
+    STUB_DEVICE,    // pc loads or stores the device register in eax, which is left to the interpreter
+} JitStubType;
+
+// an exit that's emitted after the block body, with the jump at site pointed to it
+typedef struct {
+    JitStubType type;
+    size_t site;  // offset of the rel32 to patch
+    uint16_t pc;
+    uint8_t refund;  // steps charged on block entry that didn't run
+} JitStub;
+
+void emit_u8(JitEmitter *e, uint8_t byte) {
+    e->code[e->len++] = byte;
+}
+
+void emit_u32(JitEmitter *e, uint32_t value) {
+    memcpy(&e->code[e->len], &value, sizeof(value));
+    e->len += sizeof(value);
+}
+
+void emit_u64(JitEmitter *e, uint64_t value) {
+    memcpy(&e->code[e->len], &value, sizeof(value));
+    e->len += sizeof(value);
+}
+
+// prefixes and opcode shared by every form. opcodes above 0xFF are two bytes
+void emit_opcode(JitEmitter *e, int size, uint16_t opcode, int reg, int index, int base) {
+    if (size == 16)
+        emit_u8(e, 0x66);
+    uint8_t rex = 0x40 | ((size == 64) << 3) | ((reg & 8) >> 1) | ((index & 8) >> 2) | ((base & 8) >> 3);
+    if (rex != 0x40)
+        emit_u8(e, rex);
+    if (opcode > 0xFF)
+        emit_u8(e, opcode >> 8);
+    emit_u8(e, opcode);
+}
+
+// op reg, rm. reg can also be an opcode extension
+void emit_op_reg(JitEmitter *e, int size, uint16_t opcode, int reg, int rm) {
+    emit_opcode(e, size, opcode, reg, NO_INDEX, rm);
+    emit_u8(e, 0xC0 | ((reg & 7) << 3) | (rm & 7));
+}
+
+// op reg, [base + index * (1 << scale) + disp], always with a 32 bit displacement
+void emit_op_mem(JitEmitter *e, int size, uint16_t opcode, int reg, int base, int index, int scale, int32_t disp) {
+    emit_opcode(e, size, opcode, reg, index, base);
+    if (index == NO_INDEX && (base & 7) != RSP)
+        emit_u8(e, 0x80 | ((reg & 7) << 3) | (base & 7));
+    else {
+        emit_u8(e, 0x80 | ((reg & 7) << 3) | RSP);
+        emit_u8(e, (scale << 6) | ((index & 7) << 3) | (base & 7));
+    }
+    emit_u32(e, disp);
+}
+
+void emit_mov(JitEmitter *e, int dst, int src) {
+    if (dst != src)
+        emit_op_reg(e, 32, 0x89, src, dst);
+}
+
+void emit_mov_imm(JitEmitter *e, int dst, uint32_t imm) {
+    if (dst & 8)
+        emit_u8(e, 0x41);
+    emit_u8(e, 0xB8 + (dst & 7));
+    emit_u32(e, imm);
+}
+
+// mov dword [rdi + offset], imm
+void emit_store_field(JitEmitter *e, size_t offset, uint32_t imm) {
+    emit_op_mem(e, 32, 0xC7, 0, RDI, NO_INDEX, 0, offset);
+    emit_u32(e, imm);
+}
+
+// jmp or jcc with a rel32 that gets filled in later, returning where the rel32 is
+size_t emit_jump(JitEmitter *e, uint16_t opcode) {
+    if (opcode > 0xFF)
+        emit_u8(e, opcode >> 8);
+    emit_u8(e, opcode);
+    emit_u32(e, 0);
+    return e->len - 4;
+}
+
+void patch_rel32(uint8_t *site, const uint8_t *target) {
+    int32_t rel = target - (site + 4);
+    memcpy(site, &rel, sizeof(rel));
+}
+
+// cc is only updated lazily, by keeping the value it would be worked out from
+void emit_set_cc(JitEmitter *e, uint8_t reg) {
+    emit_mov(e, RBP, GUEST(reg));
+}
+
+// leaves the address a guest instruction computed in eax, wrapped to 16 bits
+void emit_addr_base(JitEmitter *e, uint8_t base, uint16_t offset) {
+    emit_op_mem(e, 32, 0x8D, RAX, GUEST(base), NO_INDEX, 0, (int16_t)offset);
+    emit_op_reg(e, 32, 0x0FB7, RAX, RAX);
+}
+
+// stores reg to the address in eax, marks its page dirty, drops the decoded instruction there and leaves through a
+// store stub if it was translated code
+void emit_store(JitEmitter *e, uint8_t reg, JitStub *stub) {
+    emit_op_mem(e, 16, 0x89, GUEST(reg), RBX, RAX, 1, 0);
+    emit_mov(e, RDX, RAX);
+    emit_op_reg(e, 32, 0xC1, 5, RDX);
+    emit_u8(e, VM_PAGE_SHIFT);
+    emit_op_mem(e, 64, 0x8B, RCX, RDI, NO_INDEX, 0, offsetof(Jit, dirty));
+    emit_op_mem(e, 8, 0xC6, 0, RCX, RDX, 0, 0);
+    emit_u8(e, 1);
+    emit_op_mem(e, 64, 0x8B, RCX, RDI, NO_INDEX, 0, offsetof(Jit, decoded));
+    emit_op_reg(e, 32, 0x6B, RDX, RAX);
+    emit_u8(e, sizeof(VmDecoded));
+    emit_op_mem(e, 8, 0xC6, 0, RCX, RDX, 0, offsetof(VmDecoded, op));
+    emit_u8(e, VM_OP_DECODE);
+    // and the superinstructions the interpreter may have built over it
+    for (int i = 1; i < VM_FUSED_MAX_LEN; i++) {
+        emit_op_mem(e, 32, 0x8D, RDX, RAX, NO_INDEX, 0, -i);
+        emit_op_reg(e, 32, 0x0FB7, RDX, RDX);
+        emit_op_reg(e, 32, 0x6B, RDX, RDX);
+        emit_u8(e, sizeof(VmDecoded));
+        emit_op_mem(e, 8, 0xC6, 0, RCX, RDX, 0, offsetof(VmDecoded, op));
+        emit_u8(e, VM_OP_DECODE);
+    }
+    emit_op_mem(e, 8, 0x80, 7, RDI, RAX, 0, offsetof(Jit, code_map));
+    emit_u8(e, 0);
+    stub->type = STUB_STORE;
+    stub->site = emit_jump(e, 0x0F85);
+}
+
+// leaves through a device stub if the address in eax is in the device range
+void emit_device_check(JitEmitter *e, JitStub *stub) {
+    emit_op_reg(e, 32, 0x81, 7, RAX);
+    emit_u32(e, VM_DEVICE_BASE);
+    stub->type = STUB_DEVICE;
+    stub->site = emit_jump(e, 0x0F83);
+}
+
+// jumps to the block for the address in eax if there is one, otherwise leaves through an indirect stub
+void emit_indirect(Jit *jit, JitEmitter *e, JitStub *stub) {
+    // in check mode every block has to come back out to be compared
+    if (!jit->check) {
+        emit_op_mem(e, 64, 0x8B, RCX, RDI, NO_INDEX, 0, offsetof(Jit, entries));
+        emit_op_mem(e, 64, 0x8B, RCX, RCX, RAX, 3, 0);
+        emit_op_reg(e, 64, 0x85, RCX, RCX);
+        stub->site = emit_jump(e, 0x0F84);
+        emit_op_reg(e, 32, 0xFF, 4, RCX);
+    } else
+        stub->site = emit_jump(e, 0xE9);
+    stub->type = STUB_INDIRECT;
+}
+
+void emit_exit(Jit *jit, JitEmitter *e, JitExit exit) {
+    emit_mov_imm(e, RAX, exit);
+    patch_rel32(&e->code[emit_jump(e, 0xE9)], jit->exit);
+}
+
+// the entry and exit shared by every block, at the start of the buffer
+void emit_trampoline(Jit *jit) {
+    JitEmitter e = {jit->code, 0};
+    const uint8_t saved[] = {RBX, RBP, R12, R13, R14, R15};
+    for (size_t i = 0; i < sizeof(saved); i++) {
+        if (saved[i] & 8)
+            emit_u8(&e, 0x41);
+        emit_u8(&e, 0x50 + (saved[i] & 7));
+    }
+    emit_op_mem(&e, 64, 0x8B, RBX, RDI, NO_INDEX, 0, offsetof(Jit, memory));
+    for (int i = 0; i < 8; i++)
+        emit_op_mem(&e, 32, 0x0FB7, GUEST(i), RDI, NO_INDEX, 0, offsetof(Jit, reg) + i * sizeof(uint16_t));
+    emit_op_mem(&e, 32, 0x0FB7, RBP, RDI, NO_INDEX, 0, offsetof(Jit, value));
+    emit_op_reg(&e, 64, 0x89, RSI, RAX);
+    emit_op_mem(&e, 64, 0x8B, RSI, RDI, NO_INDEX, 0, offsetof(Jit, budget));
+    emit_op_reg(&e, 32, 0xFF, 4, RAX);
+
+    jit->exit = jit->code + e.len;
+    for (int i = 0; i < 8; i++)
+        emit_op_mem(&e, 16, 0x89, GUEST(i), RDI, NO_INDEX, 0, offsetof(Jit, reg) + i * sizeof(uint16_t));
+    emit_op_mem(&e, 16, 0x89, RBP, RDI, NO_INDEX, 0, offsetof(Jit, value));
+    emit_op_mem(&e, 64, 0x89, RSI, RDI, NO_INDEX, 0, offsetof(Jit, budget));
+    for (size_t i = sizeof(saved); i-- > 0;) {
+        if (saved[i] & 8)
+            emit_u8(&e, 0x41);
+        emit_u8(&e, 0x58 + (saved[i] & 7));
+    }
+    emit_u8(&e, 0xC3);
+    jit->code_start = e.len;
+}
+
+bool jit_ends_block(uint8_t op) {
+    switch (op) {
+        case VM_OP_BR:
+        case VM_OP_ADD_BR:
+        case VM_OP_JSR:
+        case VM_OP_JSRR:
+        case VM_OP_JMP:
+        case VM_OP_TRAP:
+        case VM_OP_UNIMPLEMENTED:
+        case VM_OP_DECODE:
+            return true;
+        default:
+            return false;
+    }
+}
+
+void jit_flush(Jit *jit) {
+    jit->code_len = jit->code_start;
+    jit->block_len = 0;
+    memset(jit->entries, 0, sizeof(uint8_t *) * 0x10000);
+    memset(jit->code_map, 0, sizeof(jit->code_map));
+    memset(jit->counts, 0, sizeof(jit->counts));
+}
+
+// translates the block starting at start, returning its entry point or null if it doesn't have anything to translate
+uint8_t *jit_compile(Jit *jit, uint16_t start) {
+    // work out how long the block is first, the entry check needs it
+    VmDecoded instrs[JIT_MAX_BLOCK_LEN];
+    size_t len = 0, covered = 0;
+    bool interp_end = false;
+    while (len < JIT_MAX_BLOCK_LEN && start + covered <= 0xFFFF) {
+        VmDecoded *d = &instrs[len];
+        vm_decode(jit->memory[start + covered], d);
+        covered++;
+        // device registers go through the interpreter, so a fixed address in the device range ends the block too
+        bool device = (d->op == VM_OP_LD || d->op == VM_OP_LDI || d->op == VM_OP_ST || d->op == VM_OP_STI) &&
+                      (uint16_t)(start + covered + d->imm) >= VM_DEVICE_BASE;
+        if (d->op == VM_OP_TRAP || d->op == VM_OP_UNIMPLEMENTED || device) {
+            interp_end = true;
+            break;
+        }
+        len++;
+        // BR with no flags set never branches
+        if (jit_ends_block(d->op) && !(d->op == VM_OP_BR && d->dr == 0))
+            break;
+    }
+    if (len == 0)
+        return NULL;
+
+    if (jit->code_len + JIT_BLOCK_SPACE > JIT_CODE_SIZE)
+        jit_flush(jit);
+    if (jit->block_len == jit->block_cap) {
+        jit->block_cap = jit->block_cap ? jit->block_cap * 2 : 256;
+        jit->blocks = realloc(jit->blocks, sizeof(JitBlock) * jit->block_cap);
+    }
+
+    jit->code_len = (jit->code_len + 15) & ~(size_t)15;
+    JitEmitter e = {jit->code + jit->code_len, 0};
+    JitStub stubs[JIT_MAX_BLOCK_LEN * 2 + 2];
+    size_t stub_len = 0;
+
+    // charge the whole block up front, or leave it to the interpreter if there aren't enough steps for it
+    emit_op_reg(&e, 64, 0x83, 7, RSI);
+    emit_u8(&e, len);
+    stubs[stub_len++] = (JitStub){.type = STUB_INTERP, .site = emit_jump(&e, 0x0F82), .pc = start};
+    emit_op_reg(&e, 64, 0x83, 5, RSI);
+    emit_u8(&e, len);
+
+    for (size_t i = 0; i < len; i++) {
+        const VmDecoded *d = &instrs[i];
+        uint16_t next = start + i + 1;
+        switch (d->op) {
+            case VM_OP_BR:
+                if (d->dr == 0)
+                    break;
+                if (d->dr != 0x7) {
+                    // nzp against the flags of test bp, bp
+                    static const uint16_t JCC[8] = {0, 0x0F8F, 0x0F84, 0x0F89, 0x0F88, 0x0F85, 0x0F8E};
+                    emit_op_reg(&e, 16, 0x85, RBP, RBP);
+                    stubs[stub_len++] = (JitStub){.type = STUB_CHAIN, .site = emit_jump(&e, JCC[d->dr]), .pc = next + d->imm};
+                    stubs[stub_len++] = (JitStub){.type = STUB_CHAIN, .site = emit_jump(&e, 0xE9), .pc = next};
+                } else
+                    stubs[stub_len++] = (JitStub){.type = STUB_CHAIN, .site = emit_jump(&e, 0xE9), .pc = next + d->imm};
+                break;
+            case VM_OP_ADD:
+            case VM_OP_AND: {
+                uint16_t opcode = d->op == VM_OP_ADD ? 0x01 : 0x21;
+                if (d->dr == d->sr2)
+                    emit_op_reg(&e, 16, opcode, GUEST(d->sr1), GUEST(d->dr));
+                else {
+                    emit_mov(&e, GUEST(d->dr), GUEST(d->sr1));
+                    emit_op_reg(&e, 16, opcode, GUEST(d->sr2), GUEST(d->dr));
+                }
+                emit_set_cc(&e, d->dr);
+                break;
+            }
+            case VM_OP_ADD_IMM:
+            case VM_OP_AND_IMM:
+                emit_mov(&e, GUEST(d->dr), GUEST(d->sr1));
+                emit_op_reg(&e, 16, 0x83, d->op == VM_OP_ADD_IMM ? 0 : 4, GUEST(d->dr));
+                emit_u8(&e, d->imm);
+                emit_set_cc(&e, d->dr);
+                break;
+            case VM_OP_NOT:
+                emit_mov(&e, GUEST(d->dr), GUEST(d->sr1));
+                emit_op_reg(&e, 16, 0xF7, 2, GUEST(d->dr));
+                emit_set_cc(&e, d->dr);
+                break;
+            case VM_OP_LD:
+                emit_op_mem(&e, 32, 0x0FB7, GUEST(d->dr), RBX, NO_INDEX, 0, (uint16_t)(next + d->imm) * 2);
+                emit_set_cc(&e, d->dr);
+                break;
+            case VM_OP_LDR:
+                emit_addr_base(&e, d->sr1, d->imm);
+                emit_device_check(&e, &stubs[stub_len]);
+                stubs[stub_len].pc = next - 1;
+                stubs[stub_len++].refund = len - i;
+                emit_op_mem(&e, 32, 0x0FB7, GUEST(d->dr), RBX, RAX, 1, 0);
+                emit_set_cc(&e, d->dr);
+                break;
+            case VM_OP_LDI:
+                emit_op_mem(&e, 32, 0x0FB7, RAX, RBX, NO_INDEX, 0, (uint16_t)(next + d->imm) * 2);
+                emit_device_check(&e, &stubs[stub_len]);
+                stubs[stub_len].pc = next - 1;
+                stubs[stub_len++].refund = len - i;
+                emit_op_mem(&e, 32, 0x0FB7, GUEST(d->dr), RBX, RAX, 1, 0);
+                emit_set_cc(&e, d->dr);
+                break;
+            case VM_OP_ST:
+            case VM_OP_STR:
+            case VM_OP_STI:
+                if (d->op == VM_OP_ST)
+                    emit_mov_imm(&e, RAX, (uint16_t)(next + d->imm));
+                else if (d->op == VM_OP_STR)
+                    emit_addr_base(&e, d->sr1, d->imm);
+                else
+                    emit_op_mem(&e, 32, 0x0FB7, RAX, RBX, NO_INDEX, 0, (uint16_t)(next + d->imm) * 2);
+                if (d->op != VM_OP_ST) {
+                    emit_device_check(&e, &stubs[stub_len]);
+                    stubs[stub_len].pc = next - 1;
+                    stubs[stub_len++].refund = len - i;
+                }
+                emit_store(&e, d->dr, &stubs[stub_len]);
+                stubs[stub_len].pc = next;
+                stubs[stub_len++].refund = len - (i + 1);
+                break;
+            case VM_OP_LEA:
+                emit_mov_imm(&e, GUEST(d->dr), (uint16_t)(next + d->imm));
+                break;
+            case VM_OP_JSR:
+                emit_mov_imm(&e, GUEST(7), next);
+                stubs[stub_len++] = (JitStub){.type = STUB_CHAIN, .site = emit_jump(&e, 0xE9), .pc = next + d->imm};
+                break;
+            case VM_OP_JSRR:
+            case VM_OP_JMP:
+                // read the target first, JSRR can jump through r7
+                emit_mov(&e, RAX, GUEST(d->sr1));
+                if (d->op == VM_OP_JSRR)
+                    emit_mov_imm(&e, GUEST(7), next);
+                emit_indirect(jit, &e, &stubs[stub_len++]);
+                break;
+        }
+    }
+    // ran off the end of the block, either at its length limit or at a TRAP or RTI
+    if (!jit_ends_block(instrs[len - 1].op) || (instrs[len - 1].op == VM_OP_BR && instrs[len - 1].dr == 0))
+        stubs[stub_len++] = (JitStub){.type = interp_end ? STUB_INTERP : STUB_CHAIN,
+                                      .site = emit_jump(&e, 0xE9),
+                                      .pc = start + len};
+
+    size_t dead = e.len;
+    emit_store_field(&e, offsetof(Jit, pc), start);
+    emit_exit(jit, &e, JIT_EXIT_BRANCH);
+    for (size_t i = 0; i < stub_len; i++) {
+        JitStub *stub = &stubs[i];
+        patch_rel32(&e.code[stub->site], &e.code[e.len]);
+        switch (stub->type) {
+            case STUB_CHAIN:
+                emit_store_field(&e, offsetof(Jit, pc), stub->pc);
+                // mov rdx, site; mov [rdi + patch], rdx
+                emit_u8(&e, 0x48);
+                emit_u8(&e, 0xBA);
+                emit_u64(&e, (uint64_t)(uintptr_t)&e.code[stub->site]);
+                emit_op_mem(&e, 64, 0x89, RDX, RDI, NO_INDEX, 0, offsetof(Jit, patch));
+                emit_exit(jit, &e, JIT_EXIT_CHAIN);
+                break;
+            case STUB_INDIRECT:
+                emit_op_mem(&e, 32, 0x89, RAX, RDI, NO_INDEX, 0, offsetof(Jit, pc));
+                emit_exit(jit, &e, JIT_EXIT_BRANCH);
+                break;
+            case STUB_STORE:
+                if (stub->refund) {
+                    emit_op_reg(&e, 64, 0x83, 0, RSI);
+                    emit_u8(&e, stub->refund);
+                }
+                emit_op_mem(&e, 32, 0x89, RAX, RDI, NO_INDEX, 0, offsetof(Jit, store_addr));
+                emit_store_field(&e, offsetof(Jit, pc), stub->pc);
+                emit_exit(jit, &e, JIT_EXIT_STORE);
+                break;
+            case STUB_INTERP:
+                // only the entry check and the end of the block leave this way, neither has anything to refund
+                emit_store_field(&e, offsetof(Jit, pc), stub->pc);
+                emit_exit(jit, &e, JIT_EXIT_INTERP);
+                break;
+            case STUB_DEVICE:
+                // the device access itself hasn't run either
+                emit_op_reg(&e, 64, 0x83, 0, RSI);
+                emit_u8(&e, stub->refund);
+                emit_store_field(&e, offsetof(Jit, pc), stub->pc);
+                emit_exit(jit, &e, JIT_EXIT_INTERP);
+                break;
+        }
+    }
+
+    jit->blocks[jit->block_len++] = (JitBlock){.start = start, .len = covered, .code = e.code, .dead = e.code + dead};
+    memset(&jit->code_map[start], 1, covered);
+    jit->entries[start] = e.code;
+    jit->code_len += e.len;
+    return e.code;
+}
+
+void jit_invalidate(Jit *jit, uint16_t addr, size_t len) {
+    for (size_t i = 0; i < jit->block_len;) {
+        JitBlock *block = &jit->blocks[i];
+        if (block->start < addr + len && addr < block->start + block->len) {
+            // blocks chained to this one still jump to its entry, so point that at the exit for a dead block
+            block->code[0] = 0xE9;
+            patch_rel32(&block->code[1], block->dead);
+            jit->entries[block->start] = NULL;
+            jit->counts[block->start] = 0;
+            *block = jit->blocks[--jit->block_len];
+        } else
+            i++;
+    }
+    memset(&jit->code_map[addr], 0, len);
+}
+
+bool jit_attach(VirtualMachine *vm, bool check) {
+    Jit *jit = calloc(1, sizeof(Jit));
+    if (!jit)
+        return false;
+    jit->code = mmap(NULL, JIT_CODE_SIZE, PROT_READ | PROT_WRITE | PROT_EXEC, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (jit->code == MAP_FAILED) {
+        free(jit);
+        return false;
+    }
+    // from here on jit_detach can clean up whatever got allocated
+    vm->jit = jit;
+    jit->memory = vm->memory;
+    jit->decoded = vm->decoded;
+    jit->dirty = vm->dirty;
+    jit->entries = calloc(0x10000, sizeof(uint8_t *));
+    if (!jit->entries) {
+        jit_detach(vm);
+        return false;
+    }
+    jit->vm = vm;
+    emit_trampoline(jit);
+    jit->code_len = jit->code_start;
+    if (check) {
+        jit->check = true;
+        jit->shadow = malloc(sizeof(VirtualMachine));
+        if (!jit->shadow) {
+            jit_detach(vm);
+            return false;
+        }
+        if (!vm_init(jit->shadow)) {
+            free(jit->shadow);
+            jit->shadow = NULL;
+            jit_detach(vm);
+            return false;
+        }
+    }
+    return true;
+}
+
+void jit_detach(VirtualMachine *vm) {
+    Jit *jit = vm->jit;
+    vm->jit = NULL;
+    munmap(jit->code, JIT_CODE_SIZE);
+    free(jit->entries);
+    free(jit->blocks);
+    if (jit->shadow) {
+        vm_free(jit->shadow);
+        free(jit->shadow);
+    }
+    free(jit);
+}
+
+// brings the shadow up to the state native code is about to start from
+void jit_check_begin(Jit *jit) {
+    VirtualMachine *vm = jit->vm, *shadow = jit->shadow;
+    memcpy(shadow->reg, vm->reg, sizeof(vm->reg));
+    shadow->pc = vm->pc;
+    shadow->cc = vm->cc;
+    if (memcmp(shadow->memory, vm->memory, sizeof(uint16_t) * VM_MEMORY_WORDS) == 0)
+        return;
+    for (size_t i = 0; i < 0x10000; i++) {
+        if (shadow->memory[i] != vm->memory[i]) {
+            shadow->memory[i] = vm->memory[i];
+            vm_invalidate(shadow, i, 1);
+        }
+    }
+}
+
+// runs the steps native code just ran on the shadow, and reports where they ended up different
+bool jit_check_end(Jit *jit, uint16_t start, uint64_t steps) {
+    VirtualMachine *vm = jit->vm, *shadow = jit->shadow;
+    VmStopReason reason = vm_run(shadow, steps);
+    bool same = reason == VM_STOP_STEP_LIMIT;
+    if (!same)
+        printf("\nJIT mismatch in block %04X: interpreter stopped early with %d\n", start, reason);
+    for (int i = 0; i < 8; i++) {
+        if (shadow->reg[i] != vm->reg[i]) {
+            printf("\nJIT mismatch in block %04X: r%d is %04X, interpreter has %04X\n", start, i, vm->reg[i],
+                   shadow->reg[i]);
+            same = false;
+        }
+    }
+    if (shadow->pc != vm->pc || shadow->cc != vm->cc) {
+        printf("\nJIT mismatch in block %04X: pc %04X cc %d, interpreter has pc %04X cc %d\n", start, vm->pc, vm->cc,
+               shadow->pc, shadow->cc);
+        same = false;
+    }
+    if (memcmp(shadow->memory, vm->memory, sizeof(uint16_t) * VM_MEMORY_WORDS) != 0) {
+        size_t i = 0;
+        while (shadow->memory[i] == vm->memory[i])
+            i++;
+        printf("\nJIT mismatch in block %04X: memory %04lX is %04X, interpreter has %04X\n", start, i, vm->memory[i],
+               shadow->memory[i]);
+        same = false;
+    }
+    return same;
+}
+
+VmStopReason vm_run_jit(VirtualMachine *vm, uint64_t max_steps) {
+    Jit *jit = vm->jit;
+    JitExit (*enter)(Jit *, uint8_t *) = (JitExit(*)(Jit *, uint8_t *))jit->code;
+    uint64_t steps = 0;
+    // blocks only start where control flow arrives, and interpret makes the next instruction go to the interpreter
+    bool leader = true, interpret = false;
+    while (steps < max_steps) {
+        uint16_t pc = vm->pc;
+        // native code keeps cc as a value, which can't represent the garbage cc starts out as
+        bool cc_valid = vm->cc == CC_POSITIVE || vm->cc == CC_ZERO || vm->cc == CC_NEGATIVE;
+        uint8_t *entry = jit->entries[pc];
+        if (!entry && leader && cc_valid && jit->counts[pc] < JIT_THRESHOLD && ++jit->counts[pc] == JIT_THRESHOLD)
+            entry = jit_compile(jit, pc);
+
+        if (entry && cc_valid && !interpret) {
+            memcpy(jit->reg, vm->reg, sizeof(jit->reg));
+            jit->value = vm->cc == CC_POSITIVE ? 1 : vm->cc == CC_NEGATIVE ? 0x8000 : 0;
+            jit->budget = max_steps - steps;
+            if (jit->check)
+                jit_check_begin(jit);
+            JitExit exit = enter(jit, entry);
+            uint64_t ran = max_steps - steps - jit->budget;
+            memcpy(vm->reg, jit->reg, sizeof(vm->reg));
+            vm->pc = jit->pc;
+            vm->cc = jit->value == 0 ? CC_ZERO : jit->value >> 15 ? CC_NEGATIVE : CC_POSITIVE;
+            vm->steps += ran;
+            steps += ran;
+            if (jit->check && ran && !jit_check_end(jit, pc, ran))
+                return VM_STOP_JIT_MISMATCH;
+
+            leader = true;
+            switch (exit) {
+                case JIT_EXIT_CHAIN:
+                    if (jit->entries[vm->pc] && !jit->check)
+                        patch_rel32(jit->patch, jit->entries[vm->pc]);
+                    break;
+                case JIT_EXIT_BRANCH:
+                    break;
+                case JIT_EXIT_STORE:
+                    jit_invalidate(jit, jit->store_addr, 1);
+                    leader = false;
+                    break;
+                case JIT_EXIT_INTERP:
+                    interpret = true;
+                    break;
+            }
+            continue;
+        }
+
+        // everything else is interpreted one instruction at a time
+        VmStopReason reason = vm_run_jit_fallback(vm, 1);
+        if (reason != VM_STOP_STEP_LIMIT)
+            return reason;
+        steps++;
+        interpret = false;
+        leader = jit_ends_block(vm->decoded[pc].op);
+    }
+    return VM_STOP_STEP_LIMIT;
+}
+
+#else
+
+bool jit_attach(VirtualMachine *vm, bool check) {
+    (void)vm;
+    (void)check;
+    return false;
+}
+
+void jit_detach(VirtualMachine *vm) {
+    vm->jit = NULL;
+}
+
+void jit_invalidate(Jit *jit, uint16_t addr, size_t len) {
+    (void)jit;
+    (void)addr;
+    (void)len;
+}
+
+VmStopReason vm_run_jit(VirtualMachine *vm, uint64_t max_steps) {
+    return vm_run(vm, max_steps);
+}
+
+#endif
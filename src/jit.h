@@ -0,0 +1,77 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "vm.h"
+
+// the jit translates hot basic blocks into x86-64 code. it's only built on x86-64 linux, everywhere else
+// jit_attach fails and callers stay on the interpreter
+#if defined(__x86_64__) && defined(__linux__)
+#define JIT_AVAILABLE 1
+#else
+#define JIT_AVAILABLE 0
+#endif
+
+// times a block start has to be reached before it gets translated
+#define JIT_THRESHOLD 32
+// guest instructions per block, so every block's code fits well inside the space checked before compiling
+#define JIT_MAX_BLOCK_LEN 64
+#define JIT_CODE_SIZE (8 << 20)
+
+// why native code handed control back to jit_run
+typedef enum {
+    JIT_EXIT_BRANCH,  // reached a block start that isn't translated, or an indirect target
+    JIT_EXIT_CHAIN,   // same, through a direct jump at patch that can be pointed at the target once it's translated
+    JIT_EXIT_STORE,   // stored into translated code at store_addr, pc is the next instruction
+    JIT_EXIT_INTERP,  // the instruction at pc has to be interpreted (TRAP, RTI, devices, or not enough steps left)
+} JitExit;
+
+typedef struct {
+    uint16_t start;
+    uint16_t len;  // guest words covered, including the instruction that ended it
+    uint8_t *code;
+    uint8_t *dead;  // exit taken through the entry once the block is invalidated
+} JitBlock;
+
+typedef struct Jit {
+    // read and written by the generated code, so everything it touches sits at fixed offsets up front
+    uint16_t reg[8];
+    uint16_t value;  // result of the last instruction that set cc, cc is worked out from it when leaving
+    uint32_t pc;
+    uint32_t store_addr;
+    uint64_t budget;  // steps left, the generated code counts it down
+    uint8_t *patch;   // rel32 of the jump that took a JIT_EXIT_CHAIN exit
+    uint16_t *memory;
+    VmDecoded *decoded;
+    uint8_t *dirty;
+    uint8_t **entries;  // native entry point of the block starting at each address, if any
+    uint8_t code_map[0x10000];  // nonzero where an address might be covered by a live block
+
+    VirtualMachine *vm;
+    uint8_t *code;  // starts with the entry code, which is called with the Jit and a block's entry point
+    uint8_t *exit;  // the exit every block jumps to with a JitExit in eax
+    size_t code_len;
+    size_t code_start;  // end of the entry and exit code shared by every block
+    JitBlock *blocks;
+    size_t block_len;
+    size_t block_cap;
+    uint8_t counts[0x10000];
+
+    // differential testing: each native run is repeated by the interpreter on shadow and the results compared
+    bool check;
+    VirtualMachine *shadow;
+} Jit;
+
+// gives vm a jit tier that vm_run_jit uses, returning false if the jit isn't available here
+bool jit_attach(VirtualMachine *vm, bool check);
+
+void jit_detach(VirtualMachine *vm);
+
+// throws away every block that covers an address in [addr, addr + len)
+void jit_invalidate(Jit *jit, uint16_t addr, size_t len);
+
+// like vm_run, but hot blocks run as native code, falling back to the interpreter for everything else. with check
+// mode on this also returns VM_STOP_JIT_MISMATCH as soon as native code and the interpreter disagree
+VmStopReason vm_run_jit(VirtualMachine *vm, uint64_t max_steps);
@@ -0,0 +1,328 @@
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "jit.h"
+#include "lanes.h"
+#include "vm.h"
+
+#if LANES_AVAILABLE
+
+typedef uint16_t LaneWord __attribute__((vector_size(sizeof(uint16_t) * LANES_MAX)));
+
+// a vector compare sets every bit of the lanes where it holds, and those are used as masks
+#define LANE_MASK(i_compare) ((LaneWord)(i_compare))
+// the lanes set in mask take a, the rest keep b
+#define LANE_SELECT(i_mask, i_a, i_b) (((i_a) & (i_mask)) | ((i_b) & ~(i_mask)))
+
+bool lanes_any(LaneWord mask) {
+    const LaneWord none = {0};
+    return memcmp(&mask, &none, sizeof(mask)) != 0;
+}
+
+bool lanes_equal(LaneWord a, LaneWord b) {
+    return memcmp(&a, &b, sizeof(a)) == 0;
+}
+
+LaneWord lanes_cc(LaneWord value) {
+    LaneWord zero = LANE_MASK(value == 0), negative = LANE_MASK(value >= 0x8000);
+    return (zero & CC_ZERO) | (negative & CC_NEGATIVE) | (~(zero | negative) & CC_POSITIVE);
+}
+
+// the registers of every machine, a lane each, are locals of lanes_run so they can live in vector registers. these
+// work on them
+
+// writes result to dr and sets cc from it, in the lanes of group
+#define LANES_SET(i_dr, i_result)                           \
+    do {                                                    \
+        LaneWord result_ = i_result;                        \
+        reg[i_dr] = LANE_SELECT(group, result_, reg[i_dr]); \
+        cc = LANE_SELECT(group, lanes_cc(result_), cc);     \
+    } while (0)
+
+#define LANES_SAVE(i_lane, i_vm)             \
+    do {                                     \
+        for (int i = 0; i < 8; i++)          \
+            (i_vm)->reg[i] = reg[i][i_lane]; \
+        (i_vm)->pc = pc[i_lane];             \
+        (i_vm)->cc = cc[i_lane];             \
+    } while (0)
+
+#define LANES_LOAD(i_lane, i_vm)             \
+    do {                                     \
+        for (int i = 0; i < 8; i++)          \
+            reg[i][i_lane] = (i_vm)->reg[i]; \
+        pc[i_lane] = (i_vm)->pc;             \
+        cc[i_lane] = (i_vm)->cc;             \
+    } while (0)
+
+// reads addr[lane] from the memory of each machine in group
+LaneWord lanes_gather(VirtualMachine *const *vms, size_t count, LaneWord group, LaneWord addr) {
+    LaneWord value = {0};
+    for (size_t lane = 0; lane < count; lane++) {
+        if (group[lane])
+            value[lane] = vms[lane]->memory[addr[lane]];
+    }
+    return value;
+}
+
+// stores value[lane] to addr[lane] in each machine in group, with the same bookkeeping as the interpreter's stores.
+// returns whether they all stored the same value to the same address
+bool lanes_scatter(VirtualMachine *const *vms, size_t count, LaneWord group, LaneWord addr, LaneWord value) {
+    bool uniform = true;
+    int first = -1;
+    for (size_t lane = 0; lane < count; lane++) {
+        if (!group[lane])
+            continue;
+        if (first < 0)
+            first = lane;
+        else if (addr[lane] != addr[first] || value[lane] != value[first])
+            uniform = false;
+        VirtualMachine *vm = vms[lane];
+        uint16_t at = addr[lane];
+        vm->memory[at] = value[lane];
+        for (int i = 0; i < VM_FUSED_MAX_LEN; i++)
+            vm->decoded[(uint16_t)(at - i)].op = VM_OP_DECODE;
+        vm->dirty[at >> VM_PAGE_SHIFT] = 1;
+        if (vm->jit && vm->jit->code_map[at])
+            jit_invalidate(vm->jit, at, 1);
+    }
+    return uniform;
+}
+
+#define LANES_DIFFERS(i_addr) (differs[(i_addr) >> 3] & (1 << ((i_addr) & 7)))
+#define LANES_MARK(i_addr) (differs[(i_addr) >> 3] |= 1 << ((i_addr) & 7))
+
+// takes a machine out of the run
+#define LANES_RETIRE(i_lane, i_reason)  \
+    do {                                \
+        reasons[i_lane] = i_reason;     \
+        running[i_lane] = 0;            \
+        live--;                         \
+        while (live && !running[first]) \
+            first++;                    \
+    } while (0)
+
+void lanes_run(VirtualMachine *const *vms, const uint64_t *max_steps, VmStopReason *reasons, size_t count) {
+    LaneWord reg[8] = {{0}}, pc = {0}, cc = {0}, running = {0};
+    // a tick is one instruction run by one group. a machine's steps are the ticks it wasn't left idle for, so nothing
+    // has to be counted per machine while they all run together
+    uint64_t start[LANES_MAX], idle[LANES_MAX], ticks = 0, deadline = 0;
+    for (size_t lane = 0; lane < count; lane++) {
+        LANES_LOAD(lane, vms[lane]);
+        running[lane] = 0xFFFF;
+        start[lane] = vms[lane]->steps;
+        idle[lane] = 0;
+    }
+    size_t live = count, first = 0;
+    // a bit per address the machines might not all hold the same word at, set by stores that weren't the same in
+    // all of them. anywhere else a load only has to read one of them, and machines at the same pc always have the
+    // same instruction
+    uint8_t differs[VM_MEMORY_WORDS / 8] = {0};
+    // the machines running the next instruction, all at pc at with leader the lowest of them. a group keeps running
+    // until it jumps or branches apart, or reaches a machine that's waiting, and the machines not in it are idle
+    // from the tick it started
+    LaneWord group = running;
+    size_t leader = 0;
+    uint16_t at = 0;
+    uint64_t since = 0;
+    // whether the group is every running machine, which is most of the time
+    bool repick = true, whole = true;
+    VmDecoded single;
+
+    while (live) {
+        if (ticks == deadline || repick) {
+            if (!whole) {
+                for (size_t lane = 0; lane < count; lane++)
+                    idle[lane] += running[lane] && !group[lane] ? ticks - since : 0;
+            }
+            since = ticks;
+        }
+        if (ticks == deadline) {
+            // stop the machines that are out of steps, and work out when the next one could be
+            deadline = UINT64_MAX;
+            for (size_t lane = 0; lane < count; lane++) {
+                if (!running[lane])
+                    continue;
+                if (ticks - idle[lane] == max_steps[lane]) {
+                    LANES_SAVE(lane, vms[lane]);
+                    vms[lane]->steps = start[lane] + ticks - idle[lane];
+                    LANES_RETIRE(lane, VM_STOP_STEP_LIMIT);
+                } else if (max_steps[lane] + idle[lane] < deadline)
+                    deadline = max_steps[lane] + idle[lane];
+            }
+            group = running;
+            whole = repick = true;
+            continue;
+        }
+        if (repick) {
+            leader = first;
+            at = pc[first];
+            group = running & LANE_MASK(pc == at);
+            if (!lanes_equal(group, running)) {
+                // the machines have split up. the lowest pc runs first, which is usually the group furthest behind,
+                // so the others wait for it where the paths join
+                for (size_t lane = first + 1; lane < count; lane++) {
+                    if (running[lane] && pc[lane] < at) {
+                        at = pc[lane];
+                        leader = lane;
+                    }
+                }
+                group = running & LANE_MASK(pc == at);
+            }
+            whole = lanes_equal(group, running);
+            if (LANES_DIFFERS(at)) {
+                // machines that stored something else over their code run it as a group of their own
+                for (size_t lane = leader + 1; lane < count; lane++) {
+                    if (group[lane] && vms[lane]->memory[at] != vms[leader]->memory[at])
+                        group[lane] = 0;
+                }
+                whole = lanes_equal(group, running);
+            }
+            repick = false;
+        }
+
+        // the decoded table is shared with the interpreter, which fuses superinstructions this runs one at a time
+        VirtualMachine *vm = vms[leader];
+        VmDecoded *d = &vm->decoded[at];
+        if (d->op == VM_OP_DECODE)
+            vm_decode(vm->memory[at], d);
+        else if (d->op >= VM_OP_AND_ADD) {
+            vm_decode(vm->memory[at], &single);
+            d = &single;
+        }
+        uint16_t next = at + 1;
+        LaneWord addr;
+        // set when the group may have ended up at different pcs
+        bool moved = false, scalar = false;
+        switch (d->op) {
+            case VM_OP_BR: {
+                LaneWord taken = group & LANE_MASK((cc & d->dr) != 0);
+                pc = LANE_SELECT(group, next + (taken & d->imm), pc);
+                if (lanes_equal(taken, group))
+                    next += d->imm;
+                else if (lanes_any(taken))
+                    moved = true;
+                break;
+            }
+            case VM_OP_ADD:
+                LANES_SET(d->dr, reg[d->sr1] + reg[d->sr2]);
+                pc = LANE_SELECT(group, next, pc);
+                break;
+            case VM_OP_ADD_IMM:
+                LANES_SET(d->dr, reg[d->sr1] + d->imm);
+                pc = LANE_SELECT(group, next, pc);
+                break;
+            case VM_OP_AND:
+                LANES_SET(d->dr, reg[d->sr1] & reg[d->sr2]);
+                pc = LANE_SELECT(group, next, pc);
+                break;
+            case VM_OP_AND_IMM:
+                LANES_SET(d->dr, reg[d->sr1] & d->imm);
+                pc = LANE_SELECT(group, next, pc);
+                break;
+            case VM_OP_NOT:
+                LANES_SET(d->dr, ~reg[d->sr1]);
+                pc = LANE_SELECT(group, next, pc);
+                break;
+            case VM_OP_LEA:
+                reg[d->dr] = LANE_SELECT(group, (uint16_t)(next + d->imm) + (LaneWord){0}, reg[d->dr]);
+                pc = LANE_SELECT(group, next, pc);
+                break;
+            case VM_OP_JSR:
+                reg[7] = LANE_SELECT(group, next + (LaneWord){0}, reg[7]);
+                next += d->imm;
+                pc = LANE_SELECT(group, next, pc);
+                break;
+            case VM_OP_JSRR:
+                // read the base first, it can be r7
+                addr = reg[d->sr1];
+                reg[7] = LANE_SELECT(group, next + (LaneWord){0}, reg[7]);
+                pc = LANE_SELECT(group, addr, pc);
+                moved = true;
+                break;
+            case VM_OP_JMP:
+                pc = LANE_SELECT(group, reg[d->sr1], pc);
+                moved = true;
+                break;
+            // device registers are left to the interpreter, with the console of each machine
+            case VM_OP_LD:
+            case VM_OP_ST:
+            case VM_OP_LDI:
+            case VM_OP_STI:
+            case VM_OP_LDR:
+            case VM_OP_STR:
+                if (d->op == VM_OP_LDR || d->op == VM_OP_STR)
+                    addr = reg[d->sr1] + d->imm;
+                else
+                    addr = (uint16_t)(next + d->imm) + (LaneWord){0};
+                if (lanes_any(group & LANE_MASK(addr >= VM_DEVICE_BASE))) {
+                    scalar = true;
+                    break;
+                }
+                if (d->op == VM_OP_LDI || d->op == VM_OP_STI) {
+                    // on through the pointer
+                    addr = LANES_DIFFERS(addr[leader]) ? lanes_gather(vms, count, group, addr)
+                                                       : vm->memory[addr[leader]] + (LaneWord){0};
+                    if (lanes_any(group & LANE_MASK(addr >= VM_DEVICE_BASE))) {
+                        scalar = true;
+                        break;
+                    }
+                }
+                if (d->op == VM_OP_ST || d->op == VM_OP_STI || d->op == VM_OP_STR) {
+                    bool uniform = lanes_scatter(vms, count, group, addr, reg[d->dr]);
+                    if (!uniform || !whole) {
+                        for (size_t lane = 0; lane < count; lane++) {
+                            if (group[lane])
+                                LANES_MARK(addr[lane]);
+                        }
+                    }
+                } else if (d->op == VM_OP_LD && !LANES_DIFFERS(addr[leader]))
+                    LANES_SET(d->dr, vm->memory[addr[leader]] + (LaneWord){0});
+                else
+                    LANES_SET(d->dr, lanes_gather(vms, count, group, addr));
+                pc = LANE_SELECT(group, next, pc);
+                break;
+            default:  // TRAP, RTI and the reserved opcode
+                scalar = true;
+                break;
+        }
+
+        if (scalar) {
+            for (size_t lane = 0; lane < count; lane++) {
+                if (!group[lane])
+                    continue;
+                LANES_SAVE(lane, vms[lane]);
+                vms[lane]->steps = start[lane] + ticks - idle[lane];
+                VmStopReason reason = vm_run(vms[lane], 1);
+                if (reason == VM_STOP_STEP_LIMIT)
+                    LANES_LOAD(lane, vms[lane]);
+                else
+                    LANES_RETIRE(lane, reason);
+            }
+            // a store to the device range that isn't a register goes to memory
+            if (d->op == VM_OP_ST || d->op == VM_OP_STR || d->op == VM_OP_STI)
+                memset(&differs[VM_DEVICE_BASE / 8], 0xFF, (VM_MEMORY_WORDS - VM_DEVICE_BASE) / 8);
+            moved = true;
+        }
+        ticks++;
+        // where the memory differs the next instruction can differ between the machines too
+        if (moved || LANES_DIFFERS(next))
+            repick = true;
+        else {
+            at = next;
+            if (!whole && lanes_any(running & ~group & LANE_MASK(pc == at)))
+                repick = true;
+        }
+    }
+}
+
+#else
+
+void lanes_run(VirtualMachine *const *vms, const uint64_t *max_steps, VmStopReason *reasons, size_t count) {
+    for (size_t i = 0; i < count; i++)
+        reasons[i] = vm_run(vms[i], max_steps[i]);
+}
+
+#endif
@@ -0,0 +1,27 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "vm.h"
+
+// lockstep runs keep the registers of every machine structure of arrays, one vector per register with a lane per
+// machine, so a decoded instruction runs on all of them with the host's vector instructions. 8 lanes fill an SSE
+// register, build with -mavx2 -DLANES_MAX=16 to fill an AVX2 one
+#ifndef LANES_MAX
+#define LANES_MAX 8
+#endif
+
+// vector extensions are only there with gcc and clang, everywhere else each machine just runs on its own
+#if defined(__GNUC__)
+#define LANES_AVAILABLE 1
+#else
+#define LANES_AVAILABLE 0
+#endif
+
+// runs up to LANES_MAX machines in lockstep, machine i for at most max_steps[i] instructions, and puts why each one
+// stopped in reasons. every machine has to start with the same memory, usually the same program restored from one
+// snapshot with different inputs on their consoles. machines that branch differently are split into groups by pc,
+// and the group furthest behind runs first so they come back together where the paths meet. traps, device
+// registers and RTI go through vm_run one machine at a time. each machine ends up exactly as vm_run would leave it
+void lanes_run(VirtualMachine *const *vms, const uint64_t *max_steps, VmStopReason *reasons, size_t count);
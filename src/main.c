@@ -1,28 +1,107 @@
+#include <stdbool.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <time.h>
+#include <unistd.h>
 
+#include "arena.h"
 #include "assembler/object.h"
 #include "assembler/parser.h"
+#include "assembler/source.h"
 #include "assembler/symbol.h"
 #include "assembler/token.h"
+#include "batch.h"
+#include "console.h"
+#include "jit.h"
+#include "profile.h"
+#include "utils.h"
 #include "vm.h"
 
-int main() {
+int main(int argc, char **argv) {
     int ret = 0;
-    const char *lines[] = {
-        ".orig x3000",    //
-        "LEA R0, FLOOF",  //
-        "PUTS",
-        "HALT",                        //
-        "FLOOF .stringz \"mantled\"",  //
-        ".end",                        //
-    };
+    const char demo[] =
+        ".orig x3000\n"
+        "LEA R0, FLOOF\n"
+        "PUTS\n"
+        "HALT\n"
+        "FLOOF .stringz \"mantled\"\n"
+        ".end\n";
 
+    const char *file_name = NULL, *manifest_name = NULL;
+    char *object_name = NULL;
+    bool single_pass = false, binary = false, trace = false, profile = false, jit = false, jit_check = false;
+    bool lanes = false, dump = false;
+    uint64_t max_steps = UINT64_MAX, seed = time(NULL);
+    bool seeded = false;
+    long thread_count = sysconf(_SC_NPROCESSORS_ONLN);
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--single-pass") == 0)
+            single_pass = true;
+        else if (strcmp(argv[i], "--trace") == 0)
+            trace = true;
+        else if (strcmp(argv[i], "--profile") == 0)
+            profile = true;
+        else if (strcmp(argv[i], "--jit") == 0)
+            jit = true;
+        else if (strcmp(argv[i], "--jit-check") == 0)
+            jit = jit_check = true;
+        else if (strcmp(argv[i], "--binary") == 0)
+            binary = true;
+        else if (strcmp(argv[i], "-o") == 0 && i + 1 < argc)
+            object_name = argv[++i];
+        else if (strcmp(argv[i], "--max-steps") == 0 && i + 1 < argc)
+            max_steps = strtoull(argv[++i], NULL, 10);
+        else if (strcmp(argv[i], "--seed") == 0 && i + 1 < argc) {
+            seed = strtoull(argv[++i], NULL, 10);
+            seeded = true;
+        } else if (strcmp(argv[i], "--batch") == 0 && i + 1 < argc)
+            manifest_name = argv[++i];
+        else if (strcmp(argv[i], "--threads") == 0 && i + 1 < argc)
+            thread_count = strtol(argv[++i], NULL, 10);
+        else if (strcmp(argv[i], "--lanes") == 0)
+            lanes = true;
+        else if (strcmp(argv[i], "--dump") == 0)
+            dump = true;
+        else
+            file_name = argv[i];
+    }
+
+    if (manifest_name) {
+        // batch runs default to a fixed seed so the same manifest always gives the same results
+        BatchOptions options = {thread_count > 0 ? thread_count : 1, seeded ? seed : 0, jit, lanes};
+        size_t bad_line;
+        switch (batch_run(manifest_name, &options, stdout, &bad_line)) {
+            case BA_SUCCESS:
+                return 0;
+            case BA_MANIFEST_OPEN_FAILED:
+                printf("Failed to open %s\n", manifest_name);
+                return 1;
+            case BA_BAD_MANIFEST_LINE:
+                printf("%s:%lu: expected program, input and step budget\n", manifest_name, bad_line);
+                return 1;
+            case BA_VM_INIT_FAILED:
+                printf("VM init failed.\n");
+                return 1;
+        }
+    }
+
+    SourceFile source;
+    if (file_name) {
+        if (source_file_open(&source, file_name) != SF_SUCCESS) {
+            printf("Failed to open %s\n", file_name);
+            return 1;
+        }
+    } else
+        source_file_from_text(&source, demo, sizeof(demo) - 1);
+    const SourceLine *lines = source.lines;
+
+    Arena arena;
+    arena_init(&arena);
     LineTokensList token_list;
     size_t lines_read;
-    LineTokenizerResult lt_result = tokenize_lines(&token_list, lines, sizeof(lines) / sizeof(lines[0]), &lines_read);
+    LineTokenizerResult lt_result = tokenize_lines(&arena, &token_list, lines, source.line_count, &lines_read);
     if (lt_result != LT_SUCCESS) {
         printf("Failed at line %lu: ", lines_read);
         switch (lt_result) {
@@ -35,60 +114,153 @@ int main() {
             case LT_BAD_PSEUDOOP:
                 printf("bad pseudoop\n");
                 break;
+            case LT_BAD_STRING_ESCAPE:
+                printf("bad string escape\n");
+                break;
             default:
                 break;
         }
         ret = 1;
-        goto free_tokens;
+        goto free_session;
     }
 
-    printf("Successfully parsed %lu lines:\n", lines_read);
-    for (size_t line = 0; line < token_list.len; line++) {
-        printf("LINE %lu\n", line);
-        for (size_t i = 0; i < token_list.line_tokens[line].len; i++)
-            debug_token_print(&token_list.line_tokens[line].tokens[i]);
+    // what the assembler made of the source, every token, symbol and instruction, ahead of the program's own output
+    if (dump) {
+        printf("Successfully parsed %lu lines:\n", lines_read);
+        for (size_t line = 0; line < token_list.len; line++) {
+            printf("LINE %lu\n", line);
+            for (size_t i = 0; i < token_list.line_tokens[line].len; i++)
+                debug_token_print(&token_list.line_tokens[line].tokens[i]);
+        }
     }
 
     SymbolTable symbol_table;
-    SymbolTableResult st_result = generate_symbol_table(&symbol_table, &token_list, &lines_read);
-    if (st_result != ST_SUCCESS) {
-        printf("Symbol table failed at line %lu with err %d\n", lines_read, st_result);
-        ret = 1;
-        goto free_symbols;
-    }
-
-    for (size_t i = 0; i < symbol_table.sym_len; i++)
-        printf("symbol: %s  addr: %x\n", symbol_table.symbols[i].symbol, symbol_table.symbols[i].addr);
-
     Instructions instructions;
-    ParserResult ps_result = parse_instructions(&instructions, &token_list, &symbol_table, &lines_read);
+    ObjectImage image;
+    ParserResult ps_result;
+    // big sources are parsed and encoded on several threads straight into the image, so there's no instruction list
+    // to dump. dumping keeps the list
+    bool parallel = !single_pass && !dump && parallel_threads(token_list.len, ENCODE_CHUNK_LINES) > 1;
+    if (single_pass)
+        ps_result = parse_instructions_single_pass(&arena, &instructions, &symbol_table, &token_list, &lines_read);
+    else {
+        SymbolTableResult st_result = generate_symbol_table(&arena, &symbol_table, &token_list, &lines_read);
+        if (st_result != ST_SUCCESS) {
+            printf("Symbol table failed at line %lu with err %d\n", lines_read, st_result);
+            ret = 1;
+            goto free_session;
+        }
+        if (parallel)
+            ps_result = encode_source(&arena, &image, &token_list, &symbol_table, &lines_read);
+        else
+            ps_result = parse_instructions(&arena, &instructions, &token_list, &symbol_table, &lines_read);
+    }
     if (ps_result != PS_SUCCESS) {
-        printf("Parsing failed at line %lu with err %d: %s\n", lines_read, ps_result, lines[lines_read - 1]);
+        printf("Parsing failed at line %lu with err %d: %.*s\n", lines_read, ps_result, (int)lines[lines_read - 1].len,
+               lines[lines_read - 1].start);
         ret = 1;
-        goto free_instructions;
+        goto free_session;
     }
 
-    printf("\n--Instructions len: %lu--\n", instructions.len);
-    for (size_t i = 0; i < instructions.len; i++)
-        printf("instruction: %d\n", instructions.instructions[i].type);
-    write_to_object(&instructions, "floof.obj");
+    if (dump) {
+        for (size_t i = 0; i < symbol_table.sym_len; i++)
+            printf("symbol: %.*s  addr: %x\n", (int)symbol_table.symbols[i].span_len,
+                   symbol_table.symbols[i].span_start, symbol_table.symbols[i].addr);
+        printf("\n--Instructions len: %lu--\n", instructions.len);
+        for (size_t i = 0; i < instructions.len; i++)
+            printf("instruction: %d\n", instructions.instructions[i].type);
+    }
+    if (!parallel)
+        encode_object_image(&arena, &image, &instructions);
+    if (object_name && !(binary ? write_to_binary_object : write_to_object)(&image, object_name)) {
+        printf("Failed to write %s\n", object_name);
+        ret = 1;
+        goto free_session;
+    }
+    if (object_name) {
+        // the symbols go next to the object, with the extension swapped for .sym
+        size_t len = strlen(object_name);
+        char *dot = strrchr(object_name, '.'), *slash = strrchr(object_name, '/');
+        if (dot && (!slash || dot > slash))
+            len = dot - object_name;
+        char *symbol_name = arena_alloc(&arena, len + sizeof(".sym"));
+        memcpy(symbol_name, object_name, len);
+        memcpy(symbol_name + len, ".sym", sizeof(".sym"));
+        if (!write_symbol_file(&symbol_table, symbol_name)) {
+            printf("Failed to write %s\n", symbol_name);
+            ret = 1;
+            goto free_session;
+        }
+    }
 
-    srand(time(NULL));
     VirtualMachine vm;
-    vm_randomize(&vm);
-    if (!vm_load(&vm, "floof.obj")) {
+    if (!vm_init(&vm)) {
+        printf("VM init failed.\n");
+        ret = 1;
+        goto free_session;
+    }
+    vm_randomize(&vm, seed);
+    Console console;
+    console_init(&console);
+    console_input_fd(&console, STDIN_FILENO);
+    console_output_file(&console, stdout);
+    vm.console = &console;
+    if (!vm_load_image(&vm, &image)) {
         printf("VM load failed.\n");
-        goto free_instructions;
+        ret = 1;
+        goto free_vm;
     }
 
-    while (vm_exec_next_instruction(&vm))
-        ;
+    // native code doesn't trace or profile, so those stay on the interpreter
+    if (jit && (trace || profile)) {
+        printf("The JIT can't trace or profile, using the interpreter\n");
+        jit = false;
+    }
+    if (jit && !jit_attach(&vm, jit_check)) {
+        printf("The JIT isn't available here, using the interpreter\n");
+        jit = false;
+    }
+
+    VmStopReason reason;
+    if (jit)
+        reason = vm_run_jit(&vm, max_steps);
+    else if (profile) {
+        // the per address counters are 2 MB, too much for the stack
+        vm.profile = calloc(1, sizeof(VmProfile));
+        if (!vm.profile) {
+            printf("Failed to allocate the profile\n");
+            ret = 1;
+            goto free_vm;
+        }
+        reason = vm_run_profile(&vm, max_steps);
+    } else if (trace)
+        reason = vm_run_trace(&vm, max_steps);
+    else
+        reason = vm_run(&vm, max_steps);
+    console_flush(&console);
+
+    if (reason == VM_STOP_STEP_LIMIT)
+        printf("\nStopped after %lu instructions\n", vm.steps);
+    else if (reason == VM_STOP_UNIMPLEMENTED)
+        printf("\nUnimplemented instruction %04X at %04X\n", vm.memory[vm.pc], vm.pc);
+    else if (reason == VM_STOP_INPUT_ENDED)
+        printf("\nInput ended while waiting on the keyboard at %04X\n", vm.pc);
+    else if (reason == VM_STOP_JIT_MISMATCH)
+        ret = 1;
+#ifdef VM_COUNT_DISPATCH
+    printf("\n%lu instructions in %lu dispatches\n", vm.steps, vm.dispatches);
+#endif
+
+    if (profile) {
+        profile_report(&vm, &symbol_table, stdout);
+        free(vm.profile);
+    }
 
-free_instructions:
-    free(instructions.instructions);
-free_symbols:
-    free_symbol_table(&symbol_table);
-free_tokens:
-    free_tokens_list(&token_list);
+free_vm:
+    console_free(&console);
+    vm_free(&vm);
+free_session:
+    arena_free(&arena);
+    source_file_close(&source);
     return ret;
 }
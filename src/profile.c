@@ -0,0 +1,177 @@
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "assembler/symbol.h"
+#include "profile.h"
+#include "vm.h"
+
+// the symbols sorted by address, with labels at the same address kept in the order they were defined
+typedef struct {
+    const SymbolTable *table;
+    const Symbol **symbols;
+    size_t len;
+} ProfileLabels;
+
+// one line of a table, sorted by count
+typedef struct {
+    uint64_t count;
+    uint64_t extra;
+    uint16_t addr;
+    uint16_t end;
+} ProfileRow;
+
+int compare_label_addr(const void *a, const void *b) {
+    const Symbol *x = *(const Symbol *const *)a, *y = *(const Symbol *const *)b;
+    if (x->addr != y->addr)
+        return x->addr < y->addr ? -1 : 1;
+    return x < y ? -1 : x > y;
+}
+
+int compare_row_count(const void *a, const void *b) {
+    const ProfileRow *x = a, *y = b;
+    if (x->count != y->count)
+        return x->count > y->count ? -1 : 1;
+    return x->addr - y->addr;
+}
+
+// the first label at the closest address at or before addr in the same .orig section, or null if there isn't one
+const Symbol *label_before(const ProfileLabels *labels, uint16_t addr) {
+    size_t low = 0, high = labels->len;
+    while (low < high) {
+        size_t mid = (low + high) / 2;
+        if (labels->symbols[mid]->addr <= addr)
+            low = mid + 1;
+        else
+            high = mid;
+    }
+    if (low == 0)
+        return NULL;
+    while (low > 1 && labels->symbols[low - 2]->addr == labels->symbols[low - 1]->addr)
+        low--;
+    const Symbol *label = labels->symbols[low - 1];
+    size_t section = addr_spans_upper_bound(labels->table, label->addr);
+    if (section == 0 || labels->table->addr_spans[section - 1].end_addr < addr)
+        return NULL;
+    return label;
+}
+
+// addr as LABEL+offset, or the name of the device register there
+const char *format_location(char *text, size_t cap, const ProfileLabels *labels, uint16_t addr) {
+    static const char *const DEVICES[] = {[VM_KBSR - VM_DEVICE_BASE] = "KBSR", [VM_KBDR - VM_DEVICE_BASE] = "KBDR",
+                                          [VM_DSR - VM_DEVICE_BASE] = "DSR", [VM_DDR - VM_DEVICE_BASE] = "DDR",
+                                          [VM_MCR - VM_DEVICE_BASE] = "MCR"};
+    const Symbol *label = label_before(labels, addr);
+    int name_len = label && label->span_len < 40 ? (int)label->span_len : 40;
+    if (addr >= VM_DEVICE_BASE && DEVICES[addr - VM_DEVICE_BASE])
+        snprintf(text, cap, "%s", DEVICES[addr - VM_DEVICE_BASE]);
+    else if (!label)
+        snprintf(text, cap, "x%04X", addr);
+    else if (label->addr == addr)
+        snprintf(text, cap, "%.*s", name_len, label->span_start);
+    else
+        snprintf(text, cap, "%.*s+%d", name_len, label->span_start, addr - label->addr);
+    return text;
+}
+
+double percent(uint64_t count, uint64_t total) {
+    return total ? 100.0 * count / total : 0;
+}
+
+// sorts rows and keeps the first PROFILE_REPORT_ROWS
+size_t top_rows(ProfileRow *rows, size_t len) {
+    qsort(rows, len, sizeof(ProfileRow), compare_row_count);
+    return len < PROFILE_REPORT_ROWS ? len : PROFILE_REPORT_ROWS;
+}
+
+void profile_report(const VirtualMachine *vm, const SymbolTable *symbols, FILE *out) {
+    const VmProfile *profile = vm->profile;
+    uint64_t total = vm->steps;
+    ProfileLabels labels = {symbols, NULL, 0};
+    if (symbols && symbols->sym_len) {
+        labels.symbols = malloc(sizeof(Symbol *) * symbols->sym_len);
+        for (size_t i = 0; i < symbols->sym_len; i++)
+            labels.symbols[labels.len++] = &symbols->symbols[i];
+        qsort(labels.symbols, labels.len, sizeof(Symbol *), compare_label_addr);
+    }
+    // instructions run below each address, so any range can be summed straight away
+    uint64_t *before = malloc(sizeof(uint64_t) * (VM_MEMORY_WORDS + 1));
+    before[0] = 0;
+    for (size_t i = 0; i < VM_MEMORY_WORDS; i++)
+        before[i + 1] = before[i] + profile->exec[i];
+    ProfileRow *rows = malloc(sizeof(ProfileRow) * VM_MEMORY_WORDS);
+    size_t len;
+    char from[64], to[64];
+
+    fprintf(out, "\n--Profile--\n%lu instructions\n", total);
+    for (int i = 0; i < 16; i++)
+        fprintf(out, "opcode %X: %lu\n", i, profile->op_counts[i]);
+
+    // every label owns the addresses up to the next one, and anything before the first label is shown by address
+    len = 0;
+    uint32_t start = 0;
+    for (size_t i = 0; i <= labels.len; i++) {
+        uint32_t end = i < labels.len ? (uint32_t)labels.symbols[i]->addr : VM_MEMORY_WORDS;
+        if (end == start)
+            continue;
+        if (before[end] != before[start]) {
+            // without a label the region is named after the first address that ran in it
+            uint32_t first = start;
+            while (!label_before(&labels, first) && !profile->exec[first])
+                first++;
+            rows[len++] = (ProfileRow){before[end] - before[start], 0, first, end - 1};
+        }
+        start = end;
+    }
+    len = top_rows(rows, len);
+    fprintf(out, "\nRoutines:\n%14s %7s  %s\n", "instructions", "%", "from");
+    for (size_t i = 0; i < len; i++)
+        fprintf(out, "%14lu %6.2f%%  %s\n", rows[i].count, percent(rows[i].count, total),
+                format_location(from, sizeof(from), &labels, rows[i].addr));
+
+    // a taken branch back to itself or an earlier address closes a loop, and everything between them is its body
+    len = 0;
+    for (size_t addr = 0; addr < VM_MEMORY_WORDS; addr++) {
+        if (!profile->taken[addr] || vm->memory[addr] >> 12 != 0)
+            continue;
+        VmDecoded d;
+        vm_decode(vm->memory[addr], &d);
+        uint16_t target = addr + 1 + d.imm;
+        if (target <= addr)
+            rows[len++] = (ProfileRow){before[addr + 1] - before[target], profile->taken[addr], target, addr};
+    }
+    len = top_rows(rows, len);
+    fprintf(out, "\nHot loops:\n%14s %7s %12s  %-20s  %s\n", "instructions", "%", "iterations", "from", "to");
+    for (size_t i = 0; i < len; i++)
+        fprintf(out, "%14lu %6.2f%% %12lu  %-20s  %s\n", rows[i].count, percent(rows[i].count, total), rows[i].extra,
+                format_location(from, sizeof(from), &labels, rows[i].addr),
+                format_location(to, sizeof(to), &labels, rows[i].end));
+
+    len = 0;
+    for (size_t addr = 0; addr < VM_MEMORY_WORDS; addr++) {
+        if (profile->exec[addr])
+            rows[len++] = (ProfileRow){profile->exec[addr], profile->taken[addr], addr, addr};
+    }
+    len = top_rows(rows, len);
+    fprintf(out, "\nHot instructions:\n%14s %7s %12s  %-5s  %s\n", "count", "%", "taken", "addr", "location");
+    for (size_t i = 0; i < len; i++)
+        fprintf(out, "%14lu %6.2f%% %12lu  x%04X  %s\n", rows[i].count, percent(rows[i].count, total), rows[i].extra,
+                rows[i].addr, format_location(from, sizeof(from), &labels, rows[i].addr));
+
+    len = 0;
+    for (size_t addr = 0; addr < VM_MEMORY_WORDS; addr++) {
+        if (profile->reads[addr] || profile->writes[addr])
+            rows[len++] = (ProfileRow){profile->reads[addr] + profile->writes[addr], profile->writes[addr], addr, addr};
+    }
+    len = top_rows(rows, len);
+    fprintf(out, "\nBusiest memory:\n%14s %12s  %-5s  %s\n", "reads", "writes", "addr", "location");
+    for (size_t i = 0; i < len; i++)
+        fprintf(out, "%14lu %12lu  x%04X  %s\n", rows[i].count - rows[i].extra, rows[i].extra, rows[i].addr,
+                format_location(from, sizeof(from), &labels, rows[i].addr));
+
+    free(rows);
+    free(before);
+    free(labels.symbols);
+}
@@ -0,0 +1,13 @@
+#pragma once
+
+#include <stdio.h>
+
+#include "assembler/symbol.h"
+#include "vm.h"
+
+// rows in each table of the report
+#define PROFILE_REPORT_ROWS 10
+
+// writes what vm->profile counted during the run: total steps, instructions per routine, hot loops and the busiest
+// addresses. addresses are shown relative to the closest label at or before them, symbols can be null
+void profile_report(const VirtualMachine *vm, const SymbolTable *symbols, FILE *out);
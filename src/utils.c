@@ -2,53 +2,30 @@
 
 #include <math.h>
 #include <stdbool.h>
-#include <stdio.h>
-#include <stdlib.h>
+#include <unistd.h>
 
-UnescapeResult unescape_string(const char *input, size_t input_len, char **output, size_t *output_len) {
-    bool allocated = false;
+UnescapeResult unescape_string(const char *input, size_t input_len, char *output, size_t *output_len) {
     size_t len = 0;
     for (size_t i = 0; i < input_len; i++) {
-        if (input[len++] == '\\') {
-            allocated = true;
-            switch (input[++i]) {
-                case 'n':
-                case '\\':
-                    break;
-                default:
-                    return US_INVALID_ESCAPE;
-            }
+        if (input[i] != '\\') {
+            output[len++] = input[i];
+            continue;
+        }
+        if (++i == input_len)
+            return US_INVALID_ESCAPE;
+        switch (input[i]) {
+            case 'n':
+                output[len++] = '\n';
+                break;
+            case '\\':
+                output[len++] = '\\';
+                break;
+            default:
+                return US_INVALID_ESCAPE;
         }
     }
-
-    if (!allocated)
-        return US_NO_ALLOC;
-
-    *output = malloc(len + 1);
     *output_len = len;
-    len = 0;
-    for (size_t i = 0; i < input_len; i++) {
-        if (input[len] == '\\') {
-            allocated = true;
-            char escape;
-            switch (input[++i]) {
-                case 'n':
-                    escape = '\n';
-                    break;
-                case '\\':
-                    escape = '\\';
-                    break;
-                default:
-                    printf("Unreachable unescape");
-                    exit(1);
-            }
-            (*output)[len++] = escape;
-        } else
-            (*output)[len++] = input[i];
-    }
-    (*output)[len] = 0;
-
-    return US_ALLOC;
+    return US_SUCCESS;
 }
 
 bool fit_to_bits(int32_t number, uint8_t bits, uint16_t *result) {
@@ -59,3 +36,18 @@ bool fit_to_bits(int32_t number, uint8_t bits, uint16_t *result) {
     *result = ((uint16_t)number) & (0xFFFF >> (16 - bits));
     return true;
 }
+
+uint64_t splitmix64(uint64_t *state) {
+    uint64_t z = (*state += 0x9E3779B97F4A7C15);
+    z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9;
+    z = (z ^ (z >> 27)) * 0x94D049BB133111EB;
+    return z ^ (z >> 31);
+}
+
+size_t parallel_threads(size_t len, size_t min_per_thread) {
+    long cores = sysconf(_SC_NPROCESSORS_ONLN);
+    size_t threads = len / min_per_thread;
+    if (cores > 0 && threads > (size_t)cores)
+        threads = cores;
+    return threads ? threads : 1;
+}
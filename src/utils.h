@@ -5,12 +5,32 @@
 #include <stdint.h>
 
 typedef enum {
-    US_NO_ALLOC,
-    US_ALLOC,
+    US_SUCCESS,
     US_INVALID_ESCAPE,
 } UnescapeResult;
 
-UnescapeResult unescape_string(const char *input, size_t input_len, char **output, size_t *output_len);
+// escapes only ever shrink the text, so output needs room for input_len chars
+UnescapeResult unescape_string(const char *input, size_t input_len, char *output, size_t *output_len);
 
 // returns false if number doesn't fit
 bool fit_to_bits(int32_t number, uint8_t bits, uint16_t *result);
+
+// next number from a splitmix64 generator, which only needs one u64 of state so every caller can keep its own
+uint64_t splitmix64(uint64_t *state);
+
+// how many threads to split len items across so each one gets at least min_per_thread, up to one per online core
+size_t parallel_threads(size_t len, size_t min_per_thread);
+
+// lays the branch out as the cold path, for checks on hot paths that almost never pass
+#if defined(__GNUC__)
+#define UNLIKELY(x) __builtin_expect(!!(x), 0)
+#else
+#define UNLIKELY(x) (x)
+#endif
+
+// converts a u16 between host and big endian order, which is the same operation both ways
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+#define BE16(x) __builtin_bswap16(x)
+#else
+#define BE16(x) (x)
+#endif
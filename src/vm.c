@@ -1,29 +1,173 @@
+// for memfd_create
+#define _GNU_SOURCE
+#include <fcntl.h>
 #include <stdbool.h>
 #include <stddef.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
 
+#include "assembler/object.h"
+#include "jit.h"
+#include "utils.h"
 #include "vm.h"
 
-void vm_randomize(VirtualMachine *vm) {
-    for (size_t i = 0; i < sizeof(VirtualMachine); i++)
-        ((uint8_t *)vm)[i] = rand();
+// memory followed by the decoded table, both whole pages
+#define VM_STATE_SIZE ((sizeof(uint16_t) + sizeof(VmDecoded)) * VM_MEMORY_WORDS)
+
+// forgets what the keyboard did for the last program, so a run doesn't depend on what ran before it
+void vm_reset_devices(VirtualMachine *vm) {
+    vm->kbdr = 0;
+    vm->poll_pc = 0;
+    // far enough behind any step count that the first poll never looks like a repeat
+    vm->poll_step = -(uint64_t)(VM_POLL_LOOP_STEPS + 1);
 }
 
-bool vm_load(VirtualMachine *vm, char *file_name) {
-    FILE *file = fopen(file_name, "r");
-    if (!file)
+bool vm_init(VirtualMachine *vm) {
+    memset(vm, 0, sizeof(*vm));
+    vm_reset_devices(vm);
+    void *state = mmap(NULL, VM_STATE_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (state == MAP_FAILED)
+        return false;
+    vm->memory = state;
+    vm->decoded = (VmDecoded *)(vm->memory + VM_MEMORY_WORDS);
+    return true;
+}
+
+void vm_free(VirtualMachine *vm) {
+    if (vm->jit)
+        jit_detach(vm);
+    if (vm->memory)
+        munmap(vm->memory, VM_STATE_SIZE);
+}
+
+void vm_invalidate(VirtualMachine *vm, uint16_t addr, size_t len) {
+    if (len == 0)
+        return;
+    memset(&vm->decoded[addr], 0, sizeof(VmDecoded) * len);
+    // superinstructions starting just before the range cover part of it
+    for (int i = 1; i < VM_FUSED_MAX_LEN; i++)
+        vm->decoded[(uint16_t)(addr - i)].op = VM_OP_DECODE;
+    size_t first_page = addr >> VM_PAGE_SHIFT, last_page = (addr + len - 1) >> VM_PAGE_SHIFT;
+    memset(&vm->dirty[first_page], 1, last_page - first_page + 1);
+    if (vm->jit)
+        jit_invalidate(vm->jit, addr, len);
+}
+
+// four xorshift64 generators side by side, so memory gets filled a whole vector at a time
+typedef uint64_t RandomLanes __attribute__((vector_size(32)));
+
+void vm_randomize(VirtualMachine *vm, uint64_t seed) {
+    RandomLanes lanes;
+    for (int i = 0; i < 4; i++)
+        lanes[i] = splitmix64(&seed) | 1;  // xorshift never leaves zero
+    for (size_t i = 0; i < VM_MEMORY_WORDS; i += sizeof(lanes) / sizeof(uint16_t)) {
+        lanes ^= lanes << 13;
+        lanes ^= lanes >> 7;
+        lanes ^= lanes << 17;
+        memcpy(&vm->memory[i], &lanes, sizeof(lanes));
+    }
+    for (size_t i = 0; i < 8; i += 4) {
+        uint64_t bits = splitmix64(&seed);
+        memcpy(&vm->reg[i], &bits, sizeof(bits));
+    }
+    uint64_t bits = splitmix64(&seed);
+    vm->pc = bits;
+    vm->cc = bits >> 16;
+    vm->steps = 0;
+    vm_reset_devices(vm);
+    vm_invalidate(vm, 0, VM_MEMORY_WORDS);
+}
+
+void vm_clear(VirtualMachine *vm) {
+    memset(vm->reg, 0, sizeof(vm->reg));
+    vm->pc = 0;
+    vm->cc = CC_ZERO;
+    vm->steps = 0;
+    vm_reset_devices(vm);
+    memset(vm->memory, 0, sizeof(uint16_t) * VM_MEMORY_WORDS);
+    vm_invalidate(vm, 0, VM_MEMORY_WORDS);
+}
+
+bool vm_snapshot(VirtualMachine *vm, VmSnapshot *snapshot) {
+    snapshot->fd = memfd_create("lc3-snapshot", MFD_CLOEXEC);
+    if (snapshot->fd < 0)
+        return false;
+    void *state = MAP_FAILED;
+    if (ftruncate(snapshot->fd, VM_STATE_SIZE) == 0)
+        state = mmap(NULL, VM_STATE_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, snapshot->fd, 0);
+    if (state == MAP_FAILED) {
+        close(snapshot->fd);
+        return false;
+    }
+    // the decoded table always matches memory, so it's saved too and restores don't have to decode again
+    memcpy(state, vm->memory, VM_STATE_SIZE);
+    snapshot->memory = state;
+    snapshot->decoded = (VmDecoded *)(snapshot->memory + VM_MEMORY_WORDS);
+    memcpy(snapshot->reg, vm->reg, sizeof(vm->reg));
+    snapshot->pc = vm->pc;
+    snapshot->cc = vm->cc;
+    snapshot->steps = vm->steps;
+    memset(vm->dirty, 0, sizeof(vm->dirty));
+    vm->dirty_base = snapshot;
+    return true;
+}
+
+void vm_restore_registers(VirtualMachine *vm, const VmSnapshot *snapshot) {
+    memcpy(vm->reg, snapshot->reg, sizeof(vm->reg));
+    vm->pc = snapshot->pc;
+    vm->cc = snapshot->cc;
+    vm->steps = snapshot->steps;
+    vm_reset_devices(vm);
+    memset(vm->dirty, 0, sizeof(vm->dirty));
+    vm->dirty_base = snapshot;
+}
+
+void vm_restore(VirtualMachine *vm, const VmSnapshot *snapshot) {
+    bool all = vm->dirty_base != snapshot;
+    for (size_t page = 0; page < VM_PAGE_COUNT; page++) {
+        if (!all && !vm->dirty[page])
+            continue;
+        size_t addr = page << VM_PAGE_SHIFT;
+        memcpy(&vm->memory[addr], &snapshot->memory[addr], sizeof(uint16_t) * VM_PAGE_WORDS);
+        memcpy(&vm->decoded[addr], &snapshot->decoded[addr], sizeof(VmDecoded) * VM_PAGE_WORDS);
+        // the page before may have been fused with what this page held before it was put back
+        for (int i = 1; i < VM_FUSED_MAX_LEN; i++)
+            vm->decoded[(uint16_t)(addr - i)].op = VM_OP_DECODE;
+        if (vm->jit)
+            jit_invalidate(vm->jit, addr, VM_PAGE_WORDS);
+    }
+    vm_restore_registers(vm, snapshot);
+}
+
+bool vm_fork(VirtualMachine *vm, const VmSnapshot *snapshot) {
+    // a private mapping of the snapshot's file, so the kernel copies a page the first time vm writes to it
+    if (mmap(vm->memory, VM_STATE_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_FIXED, snapshot->fd, 0) == MAP_FAILED)
         return false;
+    if (vm->jit)
+        jit_invalidate(vm->jit, 0, VM_MEMORY_WORDS);
+    vm_restore_registers(vm, snapshot);
+    return true;
+}
 
+void vm_snapshot_free(VmSnapshot *snapshot) {
+    munmap(snapshot->memory, VM_STATE_SIZE);
+    close(snapshot->fd);
+}
+
+bool vm_load_text(VirtualMachine *vm, FILE *file) {
     fscanf(file, "LC-3 OBJ FILE\n\n.TEXT\n");
-    uint16_t cur_addr, left_to_read;
-    if (fscanf(file, "%hx\n%hd\n", &cur_addr, &left_to_read) != 2)
+    uint16_t cur_addr;
+    unsigned left_to_read;  // a segment filling all of memory is 65536 words
+    if (fscanf(file, "%hx\n%u\n", &cur_addr, &left_to_read) != 2)
         return false;
     vm->pc = cur_addr;
 
     for (;;) {
-        for (int i = 0; i < left_to_read; i++) {
+        for (unsigned i = 0; i < left_to_read; i++) {
             uint16_t result = 0;
             if (fscanf(file, "%hx\n", &result) == 1)
                 vm->memory[cur_addr++] = result;
@@ -39,11 +183,98 @@ bool vm_load(VirtualMachine *vm, char *file_name) {
         else if (result != 1)
             return false;
 
-        if (fscanf(file, "%hd\n", &left_to_read) != 1)
+        if (fscanf(file, "%u\n", &left_to_read) != 1)
             return false;
     }
 }
 
+bool read_exact(int fd, void *buf, size_t len) {
+    while (len > 0) {
+        ssize_t result = read(fd, buf, len);
+        if (result <= 0)
+            return false;
+        buf = (uint8_t *)buf + result;
+        len -= result;
+    }
+    return true;
+}
+
+// the magic has already been read
+bool vm_load_binary(VirtualMachine *vm, int fd) {
+    uint16_t header[BIN_OBJ_HEADER_WORDS - 2];
+    if (!read_exact(fd, header, sizeof(header)) || BE16(header[0]) != BIN_OBJ_VERSION)
+        return false;
+
+    size_t segment_count = BE16(header[1]);
+    if (segment_count == 0)
+        return false;
+    uint16_t *segments = malloc(sizeof(uint16_t) * 2 * segment_count);
+    if (!read_exact(fd, segments, sizeof(uint16_t) * 2 * segment_count)) {
+        free(segments);
+        return false;
+    }
+
+    bool success = true;
+    for (size_t i = 0; i < segment_count && success; i++) {
+        uint16_t origin = BE16(segments[i * 2]), len = BE16(segments[i * 2 + 1]);
+        if (origin + (size_t)len > VM_MEMORY_WORDS || !read_exact(fd, &vm->memory[origin], sizeof(uint16_t) * len)) {
+            success = false;
+            break;
+        }
+        vm_invalidate(vm, origin, len);
+        for (uint16_t *word = &vm->memory[origin]; word < &vm->memory[origin + len]; word++)
+            *word = BE16(*word);
+        if (i == 0)
+            vm->pc = origin;
+    }
+
+    free(segments);
+    return success;
+}
+
+bool vm_load(VirtualMachine *vm, char *file_name) {
+    int fd = open(file_name, O_RDONLY);
+    if (fd == -1)
+        return false;
+
+    char magic[4];
+    if (read_exact(fd, magic, sizeof(magic)) && memcmp(magic, BIN_OBJ_MAGIC, sizeof(magic)) == 0) {
+        bool result = vm_load_binary(vm, fd);
+        close(fd);
+        return result;
+    }
+
+    lseek(fd, 0, SEEK_SET);
+    FILE *file = fdopen(fd, "r");
+    if (!file) {
+        close(fd);
+        return false;
+    }
+    bool result = vm_load_text(vm, file);
+    fclose(file);
+    // the text format can skip around memory, so start over completely
+    vm_invalidate(vm, 0, VM_MEMORY_WORDS);
+    return result;
+}
+
+bool vm_load_image(VirtualMachine *vm, const ObjectImage *image) {
+    if (image->segment_len == 0)
+        return false;
+
+    for (size_t i = 0; i < image->segment_len; i++) {
+        const ObjectSegment *segment = &image->segments[i];
+        if (segment->origin + (size_t)segment->len > VM_MEMORY_WORDS)
+            return false;
+        memcpy(&vm->memory[segment->origin], &image->words[segment->offset], sizeof(uint16_t) * segment->len);
+        vm_invalidate(vm, segment->origin, segment->len);
+    }
+    vm->pc = image->segments[0].origin;
+    return true;
+}
+
+// condition code for a value, indexed by (value != 0) + (value >> 15)
+const uint16_t CC_LOOKUP[3] = {CC_ZERO, CC_POSITIVE, CC_NEGATIVE};
+
 uint16_t sext(uint16_t num, uint16_t bit_count) {
     if (((num >> (bit_count - 1)) & 1) == 1)
         return num | (0xFFFF << bit_count);
@@ -51,155 +282,189 @@ uint16_t sext(uint16_t num, uint16_t bit_count) {
         return num;
 }
 
-uint16_t read_reg(const VirtualMachine *vm, uint16_t reg) {
-    return *(const uint16_t *[]){&vm->r0, &vm->r1, &vm->r2, &vm->r3, &vm->r4, &vm->r5, &vm->r6, &vm->r7}[reg];
+void vm_decode(uint16_t instr, VmDecoded *decoded) {
+    *decoded = (VmDecoded){
+        .dr = (instr >> 9) & 0x7,
+        .sr1 = (instr >> 6) & 0x7,
+        .sr2 = instr & 0x7,
+        .imm = sext(instr & 0x1FF, 9),
+    };
+    switch (instr >> 12) {
+        case 0x0:
+            decoded->op = VM_OP_BR;
+            break;
+        case 0x1:
+            decoded->op = ((instr >> 5) & 0x1) ? VM_OP_ADD_IMM : VM_OP_ADD;
+            decoded->imm = sext(instr & 0x1F, 5);
+            break;
+        case 0x2:
+            decoded->op = VM_OP_LD;
+            break;
+        case 0x3:
+            decoded->op = VM_OP_ST;
+            break;
+        case 0x4:
+            decoded->op = ((instr >> 11) & 0x1) ? VM_OP_JSR : VM_OP_JSRR;
+            decoded->imm = sext(instr & 0x7FF, 11);
+            break;
+        case 0x5:
+            decoded->op = ((instr >> 5) & 0x1) ? VM_OP_AND_IMM : VM_OP_AND;
+            decoded->imm = sext(instr & 0x1F, 5);
+            break;
+        case 0x6:
+            decoded->op = VM_OP_LDR;
+            decoded->imm = sext(instr & 0x3F, 6);
+            break;
+        case 0x7:
+            decoded->op = VM_OP_STR;
+            decoded->imm = sext(instr & 0x3F, 6);
+            break;
+        case 0x9:
+            decoded->op = VM_OP_NOT;
+            break;
+        case 0xA:
+            decoded->op = VM_OP_LDI;
+            break;
+        case 0xB:
+            decoded->op = VM_OP_STI;
+            break;
+        case 0xC:
+            decoded->op = VM_OP_JMP;
+            break;
+        case 0xE:
+            decoded->op = VM_OP_LEA;
+            break;
+        case 0xF:
+            decoded->op = VM_OP_TRAP;
+            decoded->imm = instr & 0xFF;
+            break;
+        default:  // RTI and reserved
+            decoded->op = VM_OP_UNIMPLEMENTED;
+            break;
+    }
 }
 
-void write_reg(VirtualMachine *vm, uint16_t reg, uint16_t value) {
-    *(uint16_t *[]){&vm->r0, &vm->r1, &vm->r2, &vm->r3, &vm->r4, &vm->r5, &vm->r6, &vm->r7}[reg] = value;
-    if (value == 0)
-        vm->cc = CC_ZERO;
-    else if (value >> 15)
-        vm->cc = CC_NEGATIVE;
-    else
-        vm->cc = CC_POSITIVE;
-}
-
-bool vm_exec_next_instruction(VirtualMachine *vm) {
-    uint16_t instr = vm->memory[vm->pc++];
-    printf("%04X ", instr);
-    uint16_t op_code = instr >> 12;
-    uint16_t dr, sr, sr1, sr2, br, imm5, offset, value, addr;
-    switch (op_code) {
-        case 0x0:;  // BR
-            uint16_t flags = (instr >> 9) & 0x7;
-            printf("flags: %d\n", vm->cc);
-            if (flags & vm->cc)
-                vm->pc += sext(instr & 0x1FF, 9);
-            break;
-        case 0x1:  // ADD
-            dr = (instr >> 9) & 0x7;
-            sr1 = (instr >> 6) & 0x7;
-            if ((instr >> 5) & 0x1) {
-                imm5 = sext(instr & 0x1F, 5);
-                uint16_t result = read_reg(vm, sr1) + imm5;
-                printf("add r%d, r%d, %d = %x\n", dr, sr1, imm5, result);
-                write_reg(vm, dr, result);
-            } else {
-                sr2 = instr & 0x7;
-                uint16_t result = read_reg(vm, sr1) + read_reg(vm, sr2);
-                printf("add r%d, r%d, r%d = %x\n", dr, sr1, sr2, result);
-                write_reg(vm, dr, result);
+void vm_fuse(const uint16_t *memory, uint16_t addr, VmDecoded *decoded) {
+    // sequences don't wrap around the end of memory
+    if (addr + 1 >= VM_MEMORY_WORDS)
+        return;
+    VmDecoded next, last;
+    vm_decode(memory[addr + 1], &next);
+    switch (decoded->op) {
+        case VM_OP_AND_IMM:
+            if (decoded->imm == 0 && next.op == VM_OP_ADD_IMM && next.dr == decoded->dr && next.sr1 == decoded->dr) {
+                decoded->op = VM_OP_AND_ADD;
+                decoded->imm2 = next.imm;
             }
             break;
-        case 0x2:  // LD
-            dr = (instr >> 9) & 0x7;
-            offset = sext(instr & 0x1FF, 9);
-            addr = vm->pc + offset;
-            value = vm->memory[addr];
-            printf("ld (%x) = %x\n", addr, value);
-            write_reg(vm, dr, value);
-            break;
-        case 0x3:  // ST
-            sr = (instr >> 9) & 0x7;
-            offset = sext(instr & 0x1FF, 9);
-            addr = vm->pc + offset;
-            vm->memory[addr] = read_reg(vm, sr);
-            printf("st: %d\n", read_reg(vm, sr));
-            break;
-        case 0x4:  // JSR
-            write_reg(vm, 7, vm->pc);
-            if ((instr >> 11) & 0x1)
-                vm->pc += sext(instr & 0x7FF, 11);
-            else
-                vm->pc += read_reg(vm, (instr >> 6) & 0x7);
-            printf("JSR\n");
-            break;
-        case 0x5:  // AND
-            dr = (instr >> 9) & 0x7;
-            sr1 = (instr >> 6) & 0x7;
-            if ((instr >> 5) & 0x1) {
-                imm5 = sext(instr & 0x1F, 5);
-                uint16_t result = read_reg(vm, sr1) & imm5;
-                write_reg(vm, dr, result);
-            } else {
-                sr2 = instr & 0x7;
-                uint16_t result = read_reg(vm, sr1) & read_reg(vm, sr2);
-                write_reg(vm, dr, result);
+        case VM_OP_ADD_IMM:
+            // a BR without flags never branches, so there's nothing to fuse it into
+            if (next.op == VM_OP_BR && next.dr != 0) {
+                decoded->op = VM_OP_ADD_BR;
+                decoded->sr2 = next.dr;
+                decoded->imm2 = next.imm;
             }
-            printf("\n");
-            break;
-        case 0x6:  // LDR
-            dr = (instr >> 9) & 0x7;
-            br = (instr >> 6) & 0x7;
-            offset = sext(instr & 0x3F, 6);
-            addr = read_reg(vm, br) + offset;
-            value = vm->memory[addr];
-            write_reg(vm, dr, value);
-            printf("ldr r%d, r%d, %d = %x (addr = %x)\n", dr, br, offset, value, addr);
-            break;
-        case 0x7:  // STR
-            sr = (instr >> 9) & 0x7;
-            br = (instr >> 6) & 0x7;
-            offset = sext(instr & 0x3F, 6);
-            addr = read_reg(vm, br) + offset;
-            vm->memory[addr] = read_reg(vm, sr);
-            printf("str r%d (%x) to %x\n", sr, read_reg(vm, sr), addr);
-            break;
-        case 0x8:  // RTI
-            break;
-        case 0x9:  // NOT
-            dr = (instr >> 9) & 0x7;
-            sr = (instr >> 6) & 0x7;
-            write_reg(vm, dr, ~read_reg(vm, sr));
-            printf("not r%d, r%d = %d\n", dr, sr, ~read_reg(vm, sr));
-            break;
-        case 0xA:  // LDI
-            dr = (instr >> 9) & 0x7;
-            offset = sext(instr & 0x1FF, 9);
-            addr = vm->pc + offset;
-            value = vm->memory[addr];
-            write_reg(vm, dr, vm->memory[value]);
-            printf("\n");
-            break;
-        case 0xB:  // STI
-            sr = (instr >> 9) & 0x7;
-            offset = sext(instr & 0x1FF, 9);
-            addr = vm->pc + offset;
-            value = vm->memory[addr];
-            vm->memory[value] = read_reg(vm, sr);
-            printf("\n");
-            break;
-        case 0xC:  // JMP
-            vm->pc = read_reg(vm, (instr >> 6) & 0x7);
-            printf("\n");
-            break;
-        case 0xD:  // reserved
-            break;
-        case 0xE:  // LEA
-            dr = (instr >> 9) & 0x7;
-            offset = sext(instr & 0x1FF, 9);
-            *(uint16_t *[]){
-                &vm->r0, &vm->r1, &vm->r2, &vm->r3, &vm->r4, &vm->r5, &vm->r6, &vm->r7,
-            }[dr] = vm->pc + offset;
-            printf("\n");
-            break;
-        case 0xF:;  // Trap
-            int trap = instr & 0xFF;
-            switch (trap) {
-                case 0x22:;  // PUTS
-                    uint16_t i = vm->r0;
-                    for (;;) {
-                        char c = vm->memory[i++];
-                        if (!c)
-                            break;
-                        printf("%c", c);
-                        fflush(stdout);
-                    }
-                    break;
-                case 0x25:  // HALT
-                    return false;
+            break;
+        case VM_OP_LDR:
+            // with rd as the base, the STR would go somewhere else than the LDR read from
+            if (addr + 2 >= VM_MEMORY_WORDS || decoded->dr == decoded->sr1 || next.op != VM_OP_ADD_IMM ||
+                next.dr != decoded->dr || next.sr1 != decoded->dr)
+                break;
+            vm_decode(memory[addr + 2], &last);
+            if (last.op == VM_OP_STR && last.dr == decoded->dr && last.sr1 == decoded->sr1 && last.imm == decoded->imm) {
+                decoded->op = VM_OP_LDR_ADD_STR;
+                decoded->imm2 = next.imm;
             }
+            break;
+    }
+}
+
+int32_t vm_device_read(VirtualMachine *vm, uint16_t addr, uint16_t pc, uint64_t steps) {
+    switch (addr) {
+        case VM_KBSR:
+            if (console_input_ready(vm->console))
+                return 0x8000;
+            if (vm->poll_pc == pc && steps - vm->poll_step <= VM_POLL_LOOP_STEPS) {
+                // polled again straight away, nothing but input can get the guest out of this loop
+                if (!console_wait(vm->console))
+                    return -1;
+                return 0x8000;
+            }
+            vm->poll_pc = pc;
+            vm->poll_step = steps;
+            // the guest may be waiting on input for something it just printed
+            console_flush(vm->console);
+            return 0;
+        case VM_KBDR:
+            if (console_input_ready(vm->console))
+                vm->kbdr = (uint8_t)console_getc(vm->console);
+            return vm->kbdr;
+        case VM_DSR:
+        case VM_MCR:
+            return 0x8000;
+        case VM_DDR:
+            return 0;
+        default:
+            return vm->memory[addr];
     }
-    return true;
 }
+
+bool vm_device_write(VirtualMachine *vm, uint16_t addr, uint16_t value) {
+    switch (addr) {
+        case VM_KBSR:
+        case VM_KBDR:
+        case VM_DSR:
+            // nothing to set, there are no interrupts
+            return true;
+        case VM_DDR:
+            console_putc(vm->console, value);
+            return true;
+        case VM_MCR:
+            if (value & 0x8000)
+                return true;
+            console_flush(vm->console);
+            return false;
+        default:
+            vm->memory[addr] = value;
+            vm_invalidate(vm, addr, 1);
+            return true;
+    }
+}
+
+// computed goto is a gcc/clang extension, everything else dispatches through a switch
+#if defined(__GNUC__) && !defined(VM_NO_COMPUTED_GOTO)
+#define VM_COMPUTED_GOTO 1
+#else
+#define VM_COMPUTED_GOTO 0
+#endif
+
+#define VM_RUN_NAME vm_run
+#define VM_STEP_NAME vm_exec_next_instruction_quiet
+#define VM_TRACE 0
+#define VM_PROFILE 0
+#define VM_JIT 0
+#define VM_FUSE 1
+#include "vm_run.h"
+
+#define VM_RUN_NAME vm_run_trace
+#define VM_STEP_NAME vm_exec_next_instruction_trace
+#define VM_TRACE 1
+#define VM_PROFILE 0
+#define VM_JIT 0
+#define VM_FUSE 0
+#include "vm_run.h"
+
+#define VM_RUN_NAME vm_run_profile
+#define VM_STEP_NAME vm_exec_next_instruction_profile
+#define VM_TRACE 0
+#define VM_PROFILE 1
+#define VM_JIT 0
+#define VM_FUSE 0
+#include "vm_run.h"
+
+#define VM_RUN_NAME vm_run_jit_fallback
+#define VM_TRACE 0
+#define VM_PROFILE 0
+#define VM_JIT 1
+#define VM_FUSE 0
+#include "vm_run.h"
@@ -1,26 +1,205 @@
+#pragma once
+
 #include <stdbool.h>
 #include <stdint.h>
+#include <stdio.h>
+
+#include "assembler/object.h"
+#include "console.h"
+
+enum {
+    CC_POSITIVE = 1 << 0,
+    CC_ZERO = 1 << 1,
+    CC_NEGATIVE = 1 << 2,
+};
+
+#define VM_MEMORY_WORDS 0x10000
+// memory is tracked for snapshots in 4 KB pages, the same as the host's so they can be shared copy on write
+#define VM_PAGE_SHIFT 11
+#define VM_PAGE_WORDS (1 << VM_PAGE_SHIFT)
+#define VM_PAGE_COUNT (VM_MEMORY_WORDS / VM_PAGE_WORDS)
+
+// what the profile variant counts. the per address counts are indexed by the address of the instruction, or of the
+// memory read or written
+typedef struct {
+    uint64_t op_counts[16];
+    uint64_t exec[VM_MEMORY_WORDS];
+    uint64_t taken[VM_MEMORY_WORDS];  // branches taken, and every JSR, JSRR and JMP
+    uint64_t reads[VM_MEMORY_WORDS];  // including the pointers LDI and STI go through
+    uint64_t writes[VM_MEMORY_WORDS];
+} VmProfile;
+
+// memory mapped device registers. loads and stores only look for them at or above VM_DEVICE_BASE, the rest of the
+// range is plain memory
+#define VM_DEVICE_BASE 0xFE00
+#define VM_KBSR 0xFE00  // keyboard status, bit 15 is set when a character is waiting
+#define VM_KBDR 0xFE02  // keyboard data, reading it takes the character
+#define VM_DSR 0xFE04   // display status, the display is always ready
+#define VM_DDR 0xFE06   // display data, the low byte of anything written is printed
+#define VM_MCR 0xFFFE   // machine control, clearing bit 15 halts
+// an empty keyboard poll within this many steps of the last one from the same instruction is a busy loop, and blocks
+// until there's input instead of returning
+#define VM_POLL_LOOP_STEPS 16
+
+// handlers an instruction can be predecoded into
+typedef enum {
+    VM_OP_DECODE,  // not decoded yet
+    VM_OP_BR,
+    VM_OP_ADD,
+    VM_OP_ADD_IMM,
+    VM_OP_LD,
+    VM_OP_ST,
+    VM_OP_JSR,
+    VM_OP_JSRR,
+    VM_OP_AND,
+    VM_OP_AND_IMM,
+    VM_OP_LDR,
+    VM_OP_STR,
+    VM_OP_NOT,
+    VM_OP_LDI,
+    VM_OP_STI,
+    VM_OP_JMP,
+    VM_OP_LEA,
+    VM_OP_TRAP,
+    VM_OP_UNIMPLEMENTED,
+    // superinstructions, a common sequence run as one. the entry at the first address covers the whole sequence and
+    // keeps that instruction's fields, the addresses after it still have their own entries for jumps into the middle
+    VM_OP_AND_ADD,      // AND rd, rs, #0 then ADD rd, rd, #imm2, loading a small constant
+    VM_OP_ADD_BR,       // ADD rd, rs, #imm then BR with the flags in sr2 and the offset in imm2, a loop counter
+    VM_OP_LDR_ADD_STR,  // LDR rd, base, #imm, ADD rd, rd, #imm2 and STR rd, base, #imm back, with rd not base
+    VM_OP_COUNT,
+} VmOp;
+
+// the most words a superinstruction covers. whatever writes memory has to drop the entries up to this many words
+// before it as well
+#define VM_FUSED_MAX_LEN 3
+
+// an instruction with its fields pulled out and offsets already sign extended
+typedef struct {
+    uint8_t op;     // VmOp
+    uint8_t dr;     // also sr for stores and the nzp flags for BR
+    uint8_t sr1;    // also the base register
+    uint8_t sr2;
+    uint16_t imm;   // imm5, offset, or trap vector
+    uint16_t imm2;  // the later instruction's immediate or offset in a superinstruction
+} VmDecoded;
+
+typedef struct VmSnapshot VmSnapshot;
 
 typedef struct {
-    uint16_t memory[0xFFFF];
-    uint16_t r0;
-    uint16_t r1;
-    uint16_t r2;
-    uint16_t r3;
-    uint16_t r4;
-    uint16_t r5;
-    uint16_t r6;
-    uint16_t r7;
+    uint16_t reg[8];
     uint16_t pc;
-    enum {
-        CC_POSITIVE = 1 << 0,
-        CC_ZERO = 1 << 1,
-        CC_NEGATIVE = 1 << 2,
-    } cc;
+    uint16_t cc;
+    uint64_t steps;      // instructions run so far
+#ifdef VM_COUNT_DISPATCH
+    uint64_t dispatches;  // handlers the interpreter jumped to for them, see vm_run.h
+#endif
+    VmProfile *profile;  // only used by the profile variant
+    // memory and the decoded table are one mapping, memory first, so vm_fork can map a snapshot over both
+    uint16_t *memory;
+    // one entry per address, filled in the first time it runs. anything that writes memory other than the
+    // interpreter itself has to invalidate what it wrote
+    VmDecoded *decoded;
+    struct Jit *jit;  // set by jit_attach, stores and invalidation have to go through it as well
+    // what the trap routines read and write. null reads as end of input and drops output. output still buffered
+    // when a run stops for anything but HALT stays there until console_flush
+    Console *console;
+    uint16_t kbdr;       // last character read through KBDR
+    uint16_t poll_pc;    // instruction that last found the keyboard empty
+    uint64_t poll_step;  // and when it did
+    // pages written since dirty_base was taken or restored, so restoring it only has to copy those back
+    uint8_t dirty[VM_PAGE_COUNT];
+    const VmSnapshot *dirty_base;
 } VirtualMachine;
 
-void vm_randomize(VirtualMachine *vm);
+// a saved machine state. memory and the decoded table live in a shared memory file so forks can map it
+struct VmSnapshot {
+    uint16_t reg[8];
+    uint16_t pc;
+    uint16_t cc;
+    uint64_t steps;
+    int fd;
+    uint16_t *memory;
+    VmDecoded *decoded;
+};
+
+typedef enum {
+    VM_STOP_HALT,
+    VM_STOP_STEP_LIMIT,
+    VM_STOP_UNIMPLEMENTED,  // RTI or the reserved opcode, pc is left on it
+    VM_STOP_JIT_MISMATCH,   // native code and the interpreter disagreed, only in jit check mode
+    VM_STOP_INPUT_ENDED,    // busy waiting on the keyboard after input ended, pc is left on the load
+} VmStopReason;
+
+// returns false if memory couldn't be mapped
+bool vm_init(VirtualMachine *vm);
+
+void vm_free(VirtualMachine *vm);
 
+// fills registers and memory with garbage like real hardware, the same garbage for the same seed
+void vm_randomize(VirtualMachine *vm, uint64_t seed);
+
+// zeroes registers and memory instead
+void vm_clear(VirtualMachine *vm);
+
+// has to be called after writing [addr, addr + len) of memory directly. drops the decoded instructions there so
+// they're decoded again, and marks the pages dirty
+void vm_invalidate(VirtualMachine *vm, uint16_t addr, size_t len);
+
+// saves the whole machine, and starts tracking dirty pages against the snapshot
+bool vm_snapshot(VirtualMachine *vm, VmSnapshot *snapshot);
+
+// puts vm back to the snapshot. only dirty pages are copied if vm was last snapshotted, restored or forked from this
+// snapshot, otherwise everything is
+void vm_restore(VirtualMachine *vm, const VmSnapshot *snapshot);
+
+// makes vm a copy of the snapshot that shares every page with it until vm writes to that page
+bool vm_fork(VirtualMachine *vm, const VmSnapshot *snapshot);
+
+void vm_snapshot_free(VmSnapshot *snapshot);
+
+void vm_decode(uint16_t instr, VmDecoded *decoded);
+
+// turns the instruction decoded at addr into a superinstruction if it starts one, reading the words after it
+void vm_fuse(const uint16_t *memory, uint16_t addr, VmDecoded *decoded);
+
+// a load from addr >= VM_DEVICE_BASE by the instruction at pc, steps into the run. returns -1 instead of blocking
+// forever when the keyboard is polled in a busy loop after input ended
+int32_t vm_device_read(VirtualMachine *vm, uint16_t addr, uint16_t pc, uint64_t steps);
+
+// a store to addr >= VM_DEVICE_BASE, returning false if it halted the machine
+bool vm_device_write(VirtualMachine *vm, uint16_t addr, uint16_t value);
+
+// loads either a text or binary object, telling them apart by the binary magic
 bool vm_load(VirtualMachine *vm, char *file_name);
 
-bool vm_exec_next_instruction(VirtualMachine *vm);
+// copies every segment of an assembled image into memory and starts at the first .orig, without an object file
+bool vm_load_image(VirtualMachine *vm, const ObjectImage *image);
+
+// the interpreter is built as separate variants instead of checking for tracing on every instruction. quiet doesn't
+// print anything, trace prints every instruction, and profile quietly counts into vm->profile.
+// runs until HALT, an unimplemented opcode, a busy wait on input that ended, or max_steps instructions, whichever
+// comes first
+VmStopReason vm_run(VirtualMachine *vm, uint64_t max_steps);
+VmStopReason vm_run_trace(VirtualMachine *vm, uint64_t max_steps);
+VmStopReason vm_run_profile(VirtualMachine *vm, uint64_t max_steps);
+// quiet, and also invalidates jit blocks it stores into. the jit tier runs everything it doesn't translate through this
+VmStopReason vm_run_jit_fallback(VirtualMachine *vm, uint64_t max_steps);
+
+// runs a single instruction, returning false once the machine stops
+bool vm_exec_next_instruction_quiet(VirtualMachine *vm);
+bool vm_exec_next_instruction_trace(VirtualMachine *vm);
+bool vm_exec_next_instruction_profile(VirtualMachine *vm);
+
+// the variant vm_exec_next_instruction refers to is picked when compiling: 0 quiet, 1 trace, 2 profile
+#ifndef VM_TRACE_LEVEL
+#define VM_TRACE_LEVEL 0
+#endif
+
+#if VM_TRACE_LEVEL == 0
+#define vm_exec_next_instruction vm_exec_next_instruction_quiet
+#elif VM_TRACE_LEVEL == 1
+#define vm_exec_next_instruction vm_exec_next_instruction_trace
+#else
+#define vm_exec_next_instruction vm_exec_next_instruction_profile
+#endif
@@ -0,0 +1,480 @@
+// one interpreter variant, included by vm.c once per variant. each include has to define:
+//   VM_RUN_NAME  - name of the generated run function
+//   VM_STEP_NAME - name of the generated single step function, optional
+//   VM_TRACE     - 1 to print every instruction as it runs
+//   VM_PROFILE   - 1 to count instructions, branches and memory accesses into vm->profile, which can't be null
+//   VM_JIT       - 1 to invalidate blocks of vm->jit, which can't be null, when storing into them
+//   VM_FUSE      - 1 to build and run superinstructions, otherwise they're run one instruction at a time so every
+//                  instruction is traced, counted and stepped on its own
+// so the quiet variant doesn't pay anything for tracing or profiling. building with -DVM_COUNT_DISPATCH also counts
+// every variant's dispatches into vm->dispatches, which fused sequences keep below vm->steps
+
+#if VM_TRACE
+#define TRACE(...) printf(__VA_ARGS__)
+#else
+#define TRACE(...) \
+    do {           \
+    } while (0)
+#endif
+
+#if VM_PROFILE
+#define PROFILE_COUNT()                      \
+    do {                                     \
+        profile->op_counts[instr >> 12]++;   \
+        profile->exec[(uint16_t)(pc - 1)]++; \
+    } while (0)
+#define PROFILE_TAKEN() profile->taken[(uint16_t)(pc - 1)]++
+#define PROFILE_READ(i_addr) profile->reads[i_addr]++
+#define PROFILE_WRITE(i_addr) profile->writes[i_addr]++
+#else
+#define PROFILE_COUNT() \
+    do {                \
+    } while (0)
+#define PROFILE_TAKEN() \
+    do {                \
+    } while (0)
+#define PROFILE_READ(i_addr) \
+    do {                     \
+    } while (0)
+#define PROFILE_WRITE(i_addr) \
+    do {                      \
+    } while (0)
+#endif
+
+// only tracing and profiling still look at the raw instruction, everything else runs off the decoded entry
+#if VM_TRACE || VM_PROFILE
+#define FETCH_RAW()             \
+    do {                        \
+        instr = memory[pc - 1]; \
+        TRACE("%04X ", instr);  \
+        PROFILE_COUNT();        \
+    } while (0)
+#else
+#define FETCH_RAW() \
+    do {            \
+    } while (0)
+#endif
+
+#ifdef VM_COUNT_DISPATCH
+#define COUNT_DISPATCH() dispatches++
+#else
+#define COUNT_DISPATCH() \
+    do {                 \
+    } while (0)
+#endif
+
+#define FETCH()                          \
+    do {                                 \
+        if (steps == max_steps) {        \
+            reason = VM_STOP_STEP_LIMIT; \
+            goto stop;                   \
+        }                                \
+        steps++;                         \
+        COUNT_DISPATCH();                \
+        d = &decoded[pc++];              \
+        FETCH_RAW();                     \
+    } while (0)
+
+// every handler ends with NEXT(). with computed goto that fetches and jumps straight to the next handler, otherwise
+// it goes back around the switch. REDISPATCH() runs the current instruction again once it has been decoded
+#if VM_COMPUTED_GOTO
+#define OP(i_label, i_op) i_label
+#define DISPATCH() goto *dispatch[d->op]
+#define REDISPATCH() DISPATCH()
+#define NEXT()      \
+    do {            \
+        FETCH();    \
+        DISPATCH(); \
+    } while (0)
+#else
+#define OP(i_label, i_op) case i_op
+#define REDISPATCH() goto redispatch
+#define NEXT() continue
+#endif
+
+// runs the first instruction of a superinstruction on its own
+#define FALLBACK()                                      \
+    do {                                                \
+        vm_decode(memory[(uint16_t)(pc - 1)], &single); \
+        d = &single;                                    \
+        REDISPATCH();                                   \
+    } while (0)
+
+#define SET_CC(i_value)                                 \
+    do {                                                \
+        uint16_t value_ = i_value;                      \
+        cc = CC_LOOKUP[(value_ != 0) + (value_ >> 15)]; \
+    } while (0)
+
+// device registers are only looked for at the top of memory, so ordinary loads and stores pay one compare
+#define LOAD(i_dest, i_addr)                                                       \
+    do {                                                                           \
+        uint16_t addr_ = i_addr;                                                   \
+        PROFILE_READ(addr_);                                                       \
+        if (UNLIKELY(addr_ >= VM_DEVICE_BASE)) {                                   \
+            int32_t value_ = vm_device_read(vm, addr_, pc - 1, vm->steps + steps); \
+            if (value_ < 0) {                                                      \
+                pc--;                                                              \
+                steps--;                                                           \
+                reason = VM_STOP_INPUT_ENDED;                                      \
+                goto stop;                                                         \
+            }                                                                      \
+            i_dest = value_;                                                       \
+        } else                                                                     \
+            i_dest = memory[addr_];                                                \
+    } while (0)
+
+#define DEVICE_STORE(i_addr, i_value)                 \
+    do {                                              \
+        if (!vm_device_write(vm, i_addr, i_value)) {  \
+            reason = VM_STOP_HALT;                    \
+            goto stop;                                \
+        }                                             \
+    } while (0)
+
+// a store has to drop whatever was decoded at the address it wrote, in case that's code, along with superinstructions
+// reaching over it, and mark its page dirty
+#if VM_JIT
+#define STORE(i_addr, i_value)                                \
+    do {                                                      \
+        uint16_t addr_ = i_addr;                              \
+        uint16_t value_ = i_value;                            \
+        PROFILE_WRITE(addr_);                                 \
+        if (UNLIKELY(addr_ >= VM_DEVICE_BASE))                \
+            DEVICE_STORE(addr_, value_);                      \
+        else {                                                \
+            memory[addr_] = value_;                           \
+            decoded[addr_].op = VM_OP_DECODE;                 \
+            decoded[(uint16_t)(addr_ - 1)].op = VM_OP_DECODE; \
+            decoded[(uint16_t)(addr_ - 2)].op = VM_OP_DECODE; \
+            vm->dirty[addr_ >> VM_PAGE_SHIFT] = 1;            \
+            if (vm->jit->code_map[addr_])                     \
+                jit_invalidate(vm->jit, addr_, 1);            \
+        }                                                     \
+    } while (0)
+#else
+#define STORE(i_addr, i_value)                                \
+    do {                                                      \
+        uint16_t addr_ = i_addr;                              \
+        uint16_t value_ = i_value;                            \
+        PROFILE_WRITE(addr_);                                 \
+        if (UNLIKELY(addr_ >= VM_DEVICE_BASE))                \
+            DEVICE_STORE(addr_, value_);                      \
+        else {                                                \
+            memory[addr_] = value_;                           \
+            decoded[addr_].op = VM_OP_DECODE;                 \
+            decoded[(uint16_t)(addr_ - 1)].op = VM_OP_DECODE; \
+            decoded[(uint16_t)(addr_ - 2)].op = VM_OP_DECODE; \
+            vm->dirty[addr_ >> VM_PAGE_SHIFT] = 1;            \
+        }                                                     \
+    } while (0)
+#endif
+
+VmStopReason VM_RUN_NAME(VirtualMachine *vm, uint64_t max_steps) {
+#if VM_COMPUTED_GOTO
+    static const void *const dispatch[VM_OP_COUNT] = {
+        [VM_OP_DECODE] = &&op_decode, [VM_OP_BR] = &&op_br,         [VM_OP_ADD] = &&op_add,
+        [VM_OP_ADD_IMM] = &&op_add_imm, [VM_OP_LD] = &&op_ld,         [VM_OP_ST] = &&op_st,
+        [VM_OP_JSR] = &&op_jsr,       [VM_OP_JSRR] = &&op_jsrr,     [VM_OP_AND] = &&op_and,
+        [VM_OP_AND_IMM] = &&op_and_imm, [VM_OP_LDR] = &&op_ldr,       [VM_OP_STR] = &&op_str,
+        [VM_OP_NOT] = &&op_not,       [VM_OP_LDI] = &&op_ldi,       [VM_OP_STI] = &&op_sti,
+        [VM_OP_JMP] = &&op_jmp,       [VM_OP_LEA] = &&op_lea,       [VM_OP_TRAP] = &&op_trap,
+        [VM_OP_UNIMPLEMENTED] = &&op_unimplemented,
+        [VM_OP_AND_ADD] = &&op_and_add, [VM_OP_ADD_BR] = &&op_add_br, [VM_OP_LDR_ADD_STR] = &&op_ldr_add_str,
+    };
+#endif
+    // keep the hot state in locals so it can live in registers, and only write it back when stopping
+    uint16_t *memory = vm->memory;
+    VmDecoded *decoded = vm->decoded;
+    uint16_t reg[8];
+    memcpy(reg, vm->reg, sizeof(reg));
+    uint16_t pc = vm->pc;
+    uint16_t cc = vm->cc;
+    uint64_t steps = 0;
+#ifdef VM_COUNT_DISPATCH
+    uint64_t dispatches = 0;
+#endif
+#if VM_TRACE || VM_PROFILE
+    uint16_t instr;
+#endif
+#if VM_PROFILE
+    VmProfile *profile = vm->profile;
+#endif
+    VmDecoded *d, single;
+    VmStopReason reason;
+
+    for (;;) {
+        FETCH();
+#if VM_COMPUTED_GOTO
+        DISPATCH();
+#else
+    redispatch:
+        switch (d->op) {
+#endif
+        OP(op_decode, VM_OP_DECODE) : {
+            // first time at this address since it was loaded or written, doesn't count as a step
+            vm_decode(memory[(uint16_t)(pc - 1)], d);
+#if VM_FUSE
+            vm_fuse(memory, pc - 1, d);
+#endif
+            REDISPATCH();
+        }
+        OP(op_br, VM_OP_BR) : {
+            TRACE("flags: %d\n", cc);
+            if (d->dr & cc) {
+                PROFILE_TAKEN();
+                pc += d->imm;
+            }
+            NEXT();
+        }
+        OP(op_add, VM_OP_ADD) : {
+            uint16_t result = reg[d->sr1] + reg[d->sr2];
+            TRACE("add r%d, r%d, r%d = %x\n", d->dr, d->sr1, d->sr2, result);
+            reg[d->dr] = result;
+            SET_CC(result);
+            NEXT();
+        }
+        OP(op_add_imm, VM_OP_ADD_IMM) : {
+            uint16_t result = reg[d->sr1] + d->imm;
+            TRACE("add r%d, r%d, %d = %x\n", d->dr, d->sr1, d->imm, result);
+            reg[d->dr] = result;
+            SET_CC(result);
+            NEXT();
+        }
+        OP(op_ld, VM_OP_LD) : {
+            uint16_t addr = pc + d->imm;
+            uint16_t value;
+            LOAD(value, addr);
+            TRACE("ld (%x) = %x\n", addr, value);
+            reg[d->dr] = value;
+            SET_CC(value);
+            NEXT();
+        }
+        OP(op_st, VM_OP_ST) : {
+            TRACE("st: %d\n", reg[d->dr]);
+            STORE(pc + d->imm, reg[d->dr]);
+            NEXT();
+        }
+        OP(op_jsr, VM_OP_JSR) : {
+            PROFILE_TAKEN();
+            reg[7] = pc;
+            pc += d->imm;
+            TRACE("JSR\n");
+            NEXT();
+        }
+        OP(op_jsrr, VM_OP_JSRR) : {
+            // read the base first, it can be r7
+            uint16_t target = reg[d->sr1];
+            PROFILE_TAKEN();
+            reg[7] = pc;
+            pc = target;
+            TRACE("JSR\n");
+            NEXT();
+        }
+        OP(op_and, VM_OP_AND) : {
+            uint16_t result = reg[d->sr1] & reg[d->sr2];
+            reg[d->dr] = result;
+            SET_CC(result);
+            TRACE("\n");
+            NEXT();
+        }
+        OP(op_and_imm, VM_OP_AND_IMM) : {
+            uint16_t result = reg[d->sr1] & d->imm;
+            reg[d->dr] = result;
+            SET_CC(result);
+            TRACE("\n");
+            NEXT();
+        }
+        OP(op_ldr, VM_OP_LDR) : {
+            uint16_t addr = reg[d->sr1] + d->imm;
+            uint16_t value;
+            LOAD(value, addr);
+            reg[d->dr] = value;
+            SET_CC(value);
+            TRACE("ldr r%d, r%d, %d = %x (addr = %x)\n", d->dr, d->sr1, d->imm, value, addr);
+            NEXT();
+        }
+        OP(op_str, VM_OP_STR) : {
+            uint16_t addr = reg[d->sr1] + d->imm;
+            TRACE("str r%d (%x) to %x\n", d->dr, reg[d->dr], addr);
+            STORE(addr, reg[d->dr]);
+            NEXT();
+        }
+        OP(op_not, VM_OP_NOT) : {
+            uint16_t result = ~reg[d->sr1];
+            reg[d->dr] = result;
+            SET_CC(result);
+            TRACE("not r%d, r%d = %d\n", d->dr, d->sr1, result);
+            NEXT();
+        }
+        OP(op_ldi, VM_OP_LDI) : {
+            uint16_t addr, value;
+            LOAD(addr, pc + d->imm);
+            LOAD(value, addr);
+            reg[d->dr] = value;
+            SET_CC(value);
+            TRACE("\n");
+            NEXT();
+        }
+        OP(op_sti, VM_OP_STI) : {
+            TRACE("\n");
+            uint16_t addr;
+            LOAD(addr, pc + d->imm);
+            STORE(addr, reg[d->dr]);
+            NEXT();
+        }
+        OP(op_jmp, VM_OP_JMP) : {
+            PROFILE_TAKEN();
+            pc = reg[d->sr1];
+            TRACE("\n");
+            NEXT();
+        }
+        OP(op_lea, VM_OP_LEA) : {
+            reg[d->dr] = pc + d->imm;
+            TRACE("\n");
+            NEXT();
+        }
+        OP(op_trap, VM_OP_TRAP) : {
+            Console *console = vm->console;
+            switch (d->imm) {
+                case 0x20:  // GETC
+                case 0x23: {  // IN
+                    if (d->imm == 0x23)
+                        for (const char *prompt = "Input a character> "; *prompt; prompt++)
+                            console_putc(console, *prompt);
+                    int c = console_getc(console);
+                    reg[0] = c == EOF ? 0 : c;
+                    if (d->imm == 0x23 && c != EOF)
+                        console_putc(console, c);
+                    break;
+                }
+                case 0x21:  // OUT
+                    console_putc(console, reg[0]);
+                    break;
+                case 0x22:;  // PUTS
+                    uint16_t i = reg[0];
+                    for (;;) {
+                        char c = memory[i++];
+                        if (!c)
+                            break;
+                        console_putc(console, c);
+                    }
+                    break;
+                case 0x24:  // PUTSP, two characters a word with the first in the low byte
+                    for (uint16_t addr = reg[0];; addr++) {
+                        char c = memory[addr];
+                        if (!c)
+                            break;
+                        console_putc(console, c);
+                        c = memory[addr] >> 8;
+                        if (!c)
+                            break;
+                        console_putc(console, c);
+                    }
+                    break;
+                case 0x25:  // HALT
+                    console_flush(console);
+                    reason = VM_STOP_HALT;
+                    goto stop;
+            }
+#if VM_TRACE
+            // the trace goes straight to stdout, keep the program's output in line with it
+            console_flush(console);
+#endif
+            NEXT();
+        }
+#if VM_FUSE
+        // each of these has to have the steps for the rest of its sequence left, and runs it whole
+        OP(op_and_add, VM_OP_AND_ADD) : {
+            if (steps == max_steps)
+                FALLBACK();
+            steps++;
+            pc++;
+            reg[d->dr] = d->imm2;
+            SET_CC(d->imm2);
+            NEXT();
+        }
+        OP(op_add_br, VM_OP_ADD_BR) : {
+            if (steps == max_steps)
+                FALLBACK();
+            steps++;
+            pc++;
+            uint16_t result = reg[d->sr1] + d->imm;
+            reg[d->dr] = result;
+            SET_CC(result);
+            if (d->sr2 & cc)
+                pc += d->imm2;
+            NEXT();
+        }
+        OP(op_ldr_add_str, VM_OP_LDR_ADD_STR) : {
+            uint16_t addr = reg[d->sr1] + d->imm;
+            // device registers can't be read and written back as one
+            if (max_steps - steps < 2 || addr >= VM_DEVICE_BASE)
+                FALLBACK();
+            steps += 2;
+            pc += 2;
+            uint16_t value = memory[addr] + d->imm2;
+            reg[d->dr] = value;
+            SET_CC(value);
+            STORE(addr, value);
+            NEXT();
+        }
+#else
+        OP(op_and_add, VM_OP_AND_ADD) :
+        OP(op_add_br, VM_OP_ADD_BR) :
+        OP(op_ldr_add_str, VM_OP_LDR_ADD_STR) : {
+            FALLBACK();
+        }
+#endif
+        OP(op_unimplemented, VM_OP_UNIMPLEMENTED) : {
+            // leave pc on the instruction that couldn't run
+            pc--;
+            steps--;
+            reason = VM_STOP_UNIMPLEMENTED;
+            goto stop;
+        }
+#if !VM_COMPUTED_GOTO
+        }
+#endif
+    }
+
+stop:
+    memcpy(vm->reg, reg, sizeof(reg));
+    vm->pc = pc;
+    vm->cc = cc;
+    vm->steps += steps;
+#ifdef VM_COUNT_DISPATCH
+    vm->dispatches += dispatches;
+#endif
+    return reason;
+}
+
+#ifdef VM_STEP_NAME
+bool VM_STEP_NAME(VirtualMachine *vm) {
+    return VM_RUN_NAME(vm, 1) == VM_STOP_STEP_LIMIT;
+}
+#endif
+
+#undef TRACE
+#undef PROFILE_COUNT
+#undef PROFILE_TAKEN
+#undef PROFILE_READ
+#undef PROFILE_WRITE
+#undef FETCH_RAW
+#undef COUNT_DISPATCH
+#undef FETCH
+#undef OP
+#undef DISPATCH
+#undef REDISPATCH
+#undef NEXT
+#undef FALLBACK
+#undef SET_CC
+#undef LOAD
+#undef DEVICE_STORE
+#undef STORE
+#undef VM_RUN_NAME
+#undef VM_STEP_NAME
+#undef VM_TRACE
+#undef VM_PROFILE
+#undef VM_JIT
+#undef VM_FUSE